@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "Common.hpp"
+#include "Output.hpp"
+#include "Passes.hpp"
+
+using namespace llvm;
+
+static cl::list<std::string> shapes(
+    "shapes",
+    cl::desc("Shapes of the generated functions: loops, nest, switch, irreducible"),
+    cl::CommaSeparated
+);
+
+static cl::list<u32> fusible_loops(
+    "fusible-loops",
+    cl::desc("Numbers of sequential fusible loops of the loops shape"),
+    cl::CommaSeparated
+);
+
+static cl::list<u32> nest_depths(
+    "nest-depths",
+    cl::desc("Depths of the loop nests of the nest shape"),
+    cl::CommaSeparated
+);
+
+static cl::list<u32> switch_blocks(
+    "switch-blocks",
+    cl::desc("Numbers of cases of the switch shape"),
+    cl::CommaSeparated
+);
+
+static cl::list<u32> irreducible_blocks(
+    "irreducible-blocks",
+    cl::desc("Numbers of blocks of the irreducible shape"),
+    cl::CommaSeparated
+);
+
+static cl::list<std::string> bench_passes(
+    "bench-passes",
+    cl::desc("Function passes to time, all of them by default"),
+    cl::CommaSeparated
+);
+
+static cl::opt<u32> repetitions(
+    "repetitions",
+    cl::desc("Runs of every pass on every function, the minimum and the median are reported"),
+    cl::init(5)
+);
+
+static cl::opt<std::string> output_file(
+    "o",
+    cl::desc("Write the results as JSON to this file"),
+    cl::value_desc("filename"),
+    cl::init("-")
+);
+
+static cl::opt<std::string> emit_ir_dir(
+    "emit-ir-dir",
+    cl::desc("Also write the generated functions to <directory>/<shape>.<size>.ll, to run them with opt or custom-opt"),
+    cl::value_desc("directory")
+);
+
+/* CFGDot only writes files, InstrDiff and the other module passes need more than one function. */
+static const char *const default_passes[] = {
+    "RPOPrint", "ArgPrint", "InstrCount", "TripCount", "Inductions", "Loop", "StaticFreq", "LoopCost",
+    "IVRange", "BoundsCheckElim", "IVCanonicalize", "AffineAccess", "RegPressure", "CriticalPath", "LoopFusion",
+};
+
+namespace {
+
+/* Builds the body of a single function @bench(ptr %a, i32 %n) with the locals in allocas,
+ * like clang -O0 emits them, as that is the input LoopFusion expects. */
+struct Generator {
+    LLVMContext &context;
+    Function *func;
+    IRBuilder<> builder;
+    Type *i32;
+    Value *array;
+    Value *limit;
+
+    Generator(Module &module)
+        : context(module.getContext()), builder(module.getContext()), i32(Type::getInt32Ty(module.getContext())) {
+        auto *type = FunctionType::get(
+            Type::getVoidTy(context), {PointerType::getUnqual(i32), i32}, false
+        );
+        func = Function::Create(type, Function::ExternalLinkage, "bench", module);
+        array = func->getArg(0);
+        array->setName("a");
+        func->getArg(1)->setName("n");
+
+        builder.SetInsertPoint(BasicBlock::Create(context, "entry", func));
+        limit = local("n.addr");
+        builder.CreateStore(func->getArg(1), limit);
+    }
+
+    BasicBlock *block(const Twine &name) {
+        return BasicBlock::Create(context, name, func);
+    }
+
+    Value *local(const Twine &name) {
+        BasicBlock &entry = func->getEntryBlock();
+        IRBuilder<> allocas(&entry, entry.begin());
+        return allocas.CreateAlloca(i32, nullptr, name);
+    }
+
+    /* a[index] = a[index] <op> value, the operation depends on seed. */
+    void update_element(Value *index, u32 seed, Value *value) {
+        Value *offset = builder.CreateSExt(index, builder.getInt64Ty());
+        Value *element = builder.CreateInBoundsGEP(i32, array, offset);
+        Value *loaded = builder.CreateLoad(i32, element);
+        Value *result;
+        switch (seed % 4) {
+        case 0: result = builder.CreateNSWAdd(loaded, value); break;
+        case 1: result = builder.CreateNSWMul(loaded, value); break;
+        case 2: result = builder.CreateAShr(loaded, value); break;
+        default: result = builder.CreateAnd(loaded, value); break;
+        }
+        builder.CreateStore(result, element);
+    }
+
+    /* for (i = 0; i < n; i += 0) { body(i); i = i + 1; }
+     * The counter is advanced in the body, LoopFusion only takes loops whose induction variable
+     * is stored there, the latch keeps the advance it compares between loops.
+     * Leaves the builder in the exit block. */
+    void counted_loop(const Twine &name, function_ref<void(Value *)> body) {
+        Value *counter = local(name + ".i");
+        BasicBlock *cond = block(name + ".cond");
+        BasicBlock *loop_body = block(name + ".body");
+        BasicBlock *inc = block(name + ".inc");
+        BasicBlock *end = block(name + ".end");
+
+        builder.CreateStore(builder.getInt32(0), counter);
+        builder.CreateBr(cond);
+
+        builder.SetInsertPoint(cond);
+        Value *index = builder.CreateLoad(i32, counter);
+        Value *stop = builder.CreateLoad(i32, limit);
+        builder.CreateCondBr(builder.CreateICmpSLT(index, stop), loop_body, end);
+
+        builder.SetInsertPoint(loop_body);
+        Value *current = builder.CreateLoad(i32, counter);
+        body(current);
+        builder.CreateStore(builder.CreateNSWAdd(current, builder.getInt32(1)), counter);
+        builder.CreateBr(inc);
+
+        builder.SetInsertPoint(inc);
+        Value *advanced = builder.CreateLoad(i32, counter);
+        builder.CreateStore(builder.CreateNSWAdd(advanced, builder.getInt32(0)), counter);
+        builder.CreateBr(cond);
+
+        builder.SetInsertPoint(end);
+    }
+
+    /* N adjacent loops with the same bounds over the same array, every pair may be fused. */
+    void loops(u32 count) {
+        for (u32 i = 0; i < count; ++i) {
+            counted_loop("loop" + Twine(i), [&](Value *index) {
+                update_element(index, i, builder.getInt32(i + 3));
+            });
+        }
+        builder.CreateRetVoid();
+    }
+
+    /* A perfect nest of the given depth, the innermost loop updates the array. */
+    void nest(u32 depth, u32 level = 0) {
+        counted_loop("nest" + Twine(level), [&](Value *index) {
+            if (level + 1 < depth) {
+                nest(depth, level + 1);
+            } else {
+                update_element(index, level, builder.getInt32(level + 3));
+            }
+        });
+        if (level == 0) builder.CreateRetVoid();
+    }
+
+    /* A dispatch loop around a switch with one block per case, every case falls through
+     * to the next one or returns to the dispatch, the default case leaves the loop. */
+    void switch_cases(u32 count) {
+        Value *state = local("state");
+        builder.CreateStore(builder.getInt32(0), state);
+        BasicBlock *dispatch = block("dispatch");
+        BasicBlock *exit = block("exit");
+        builder.CreateBr(dispatch);
+
+        Array<BasicBlock *> cases(count);
+        for (u32 i = 0; i < count; ++i) {
+            cases[i] = block("case" + Twine(i));
+        }
+
+        builder.SetInsertPoint(dispatch);
+        Value *current = builder.CreateLoad(i32, state);
+        SwitchInst *branch = builder.CreateSwitch(current, exit, count);
+        for (u32 i = 0; i < count; ++i) {
+            branch->addCase(builder.getInt32(i), cases[i]);
+        }
+
+        for (u32 i = 0; i < count; ++i) {
+            builder.SetInsertPoint(cases[i]);
+            Value *value = builder.CreateLoad(i32, state);
+            update_element(builder.getInt32(i), i, value);
+
+            Value *next = builder.CreateNSWAdd(builder.CreateNSWMul(value, builder.getInt32(5)), builder.getInt32(i + 1));
+            builder.CreateStore(builder.CreateURem(next, builder.getInt32(count + 1)), state);
+
+            BasicBlock *fallthrough = i + 1 < count ? cases[i + 1] : dispatch;
+            builder.CreateCondBr(builder.CreateICmpULT(next, builder.getInt32(i)), fallthrough, dispatch);
+        }
+
+        builder.SetInsertPoint(exit);
+        builder.CreateRetVoid();
+    }
+
+    /* A chain of blocks with branches back into it from pseudo-random places,
+     * entered both at the first and the middle block, so the cycles have several entries. */
+    void irreducible(u32 count) {
+        Array<BasicBlock *> nodes(count);
+        for (u32 i = 0; i < count; ++i) {
+            nodes[i] = block("node" + Twine(i));
+        }
+        BasicBlock *exit = block("exit");
+
+        Value *negative = builder.CreateICmpSLT(func->getArg(1), builder.getInt32(0));
+        builder.CreateCondBr(negative, nodes[0], nodes[count / 2]);
+
+        for (u32 i = 0; i < count; ++i) {
+            builder.SetInsertPoint(nodes[i]);
+            update_element(builder.getInt32(i), i, func->getArg(1));
+
+            Value *element = builder.CreateInBoundsGEP(i32, array, builder.getInt64(i));
+            Value *taken = builder.CreateICmpSGT(builder.CreateLoad(i32, element), func->getArg(1));
+            BasicBlock *next = i + 1 < count ? nodes[i + 1] : exit;
+            BasicBlock *back = nodes[((u64)i * 7919 + 13) % count];
+            builder.CreateCondBr(taken, back, next);
+        }
+
+        builder.SetInsertPoint(exit);
+        builder.CreateRetVoid();
+    }
+};
+
+struct Measurement {
+    std::string shape;
+    u32 size;
+    u32 blocks;
+    u32 loops;
+    u32 instructions;
+    std::string pass;
+    f64 min_ns;
+    f64 median_ns;
+};
+
+}  // namespace
+
+static Array<u32> sizes_or_default(const cl::list<u32> &sizes, std::initializer_list<u32> defaults) {
+    if (sizes.empty()) return Array<u32>(defaults);
+    return Array<u32>(sizes.begin(), sizes.end());
+}
+
+static std::unique_ptr<TargetMachine> create_target_machine(void) {
+    std::string triple = sys::getDefaultTargetTriple();
+
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(triple, error);
+    if (!target) return nullptr;
+
+    return std::unique_ptr<TargetMachine>(
+        target->createTargetMachine(triple, "generic", "", TargetOptions(), std::nullopt)
+    );
+}
+
+static std::unique_ptr<Module> generate(LLVMContext &context, StringRef shape, u32 size, TargetMachine *TM) {
+    auto module = std::make_unique<Module>((shape + "." + Twine(size)).str(), context);
+    if (TM) {
+        module->setTargetTriple(TM->getTargetTriple().str());
+        module->setDataLayout(TM->createDataLayout());
+    }
+
+    Generator generator(*module);
+    if (shape == "loops") {
+        generator.loops(size);
+    } else if (shape == "nest") {
+        generator.nest(std::max(size, 1u));
+    } else if (shape == "switch") {
+        generator.switch_cases(std::max(size, 1u));
+    } else {
+        generator.irreducible(std::max(size, 2u));
+    }
+    return module;
+}
+
+/* Time of one run of the pass on a fresh copy of the function, with its analyses computed from scratch,
+ * as they are on the first pass that needs them in a pipeline. */
+static f64 time_pass(const Module &generated, StringRef pass_name, TargetMachine *TM) {
+    std::unique_ptr<Module> module = CloneModule(generated);
+    Function &func = *module->getFunction("bench");
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(TM);
+    get_plugin_info().RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    FunctionPassManager FPM;
+    if (auto error = PB.parsePassPipeline(FPM, pass_name)) {
+        report_fatal_error(Twine("custom-bench: ") + toString(std::move(error)), false);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    FPM.run(func, FAM);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<f64, std::nano>(end - start).count();
+}
+
+static void count_function(const Module &module, Measurement &measurement) {
+    Function &func = *module.getFunction("bench");
+    DominatorTree DT(func);
+    LoopInfo LI(DT);
+
+    measurement.blocks = func.size();
+    measurement.loops = LI.getLoopsInPreorder().size();
+    measurement.instructions = func.getInstructionCount();
+}
+
+static void emit_ir(const Module &module) {
+    if (emit_ir_dir.empty()) return;
+
+    SmallString<128> path(emit_ir_dir);
+    sys::fs::create_directories(path);
+    sys::path::append(path, module.getModuleIdentifier() + ".ll");
+
+    std::error_code error;
+    raw_fd_ostream os(path, error, sys::fs::OF_Text);
+    if (error) {
+        errs() << "custom-bench: can not open " << path << ": " << error.message() << "\n";
+        return;
+    }
+    module.print(os, nullptr);
+}
+
+static void write_json(raw_ostream &os, ArrayRef<Measurement> measurements) {
+    json::OStream json(os, 2);
+    json.object([&] {
+        json.attribute("version", PLUGIN_VERSION);
+        json.attribute("repetitions", (s64)repetitions);
+        json.attributeArray("results", [&] {
+            for (auto &m : measurements) {
+                json.object([&] {
+                    json.attribute("shape", m.shape);
+                    json.attribute("size", (s64)m.size);
+                    json.attribute("pass", m.pass);
+                    json.attribute("blocks", (s64)m.blocks);
+                    json.attribute("loops", (s64)m.loops);
+                    json.attribute("instructions", (s64)m.instructions);
+                    json.attribute("min_ns", m.min_ns);
+                    json.attribute("median_ns", m.median_ns);
+                    json.attribute("ns_per_block", m.min_ns / m.blocks);
+                    if (m.loops) {
+                        json.attribute("ns_per_loop", m.min_ns / m.loops);
+                    } else {
+                        json.attribute("ns_per_loop", nullptr);
+                    }
+                });
+            }
+        });
+    });
+    os << "\n";
+}
+
+int main(int argc, char **argv) {
+    InitLLVM init(argc, argv);
+    InitializeNativeTarget();
+    cl::ParseCommandLineOptions(
+        argc, argv,
+        "Times every custom pass on generated functions of growing size, to catch passes\n"
+        "that do not scale linearly with the number of blocks or loops\n"
+    );
+
+    Array<std::string> shape_names(shapes.begin(), shapes.end());
+    if (shape_names.empty()) shape_names = {"loops", "nest", "switch", "irreducible"};
+    Array<std::string> pass_names(bench_passes.begin(), bench_passes.end());
+    if (pass_names.empty()) pass_names.assign(std::begin(default_passes), std::end(default_passes));
+
+    std::unique_ptr<TargetMachine> TM = create_target_machine();
+
+    /* Only the time matters, the text or records of the passes are dropped. */
+    ScopedOutput scoped(nulls());
+
+    Array<Measurement> measurements;
+    for (auto &shape : shape_names) {
+        Array<u32> sizes;
+        if (shape == "loops") {
+            sizes = sizes_or_default(fusible_loops, {4, 16, 64, 256});
+        } else if (shape == "nest") {
+            sizes = sizes_or_default(nest_depths, {2, 4, 8, 16});
+        } else if (shape == "switch") {
+            sizes = sizes_or_default(switch_blocks, {16, 64, 256, 1024});
+        } else if (shape == "irreducible") {
+            sizes = sizes_or_default(irreducible_blocks, {16, 64, 256, 1024});
+        } else {
+            errs() << "custom-bench: unknown shape " << shape << "\n";
+            return 1;
+        }
+
+        for (u32 size : sizes) {
+            LLVMContext context;
+            std::unique_ptr<Module> module = generate(context, shape, size, TM.get());
+            emit_ir(*module);
+
+            for (auto &pass : pass_names) {
+                Measurement &m = measurements.emplace_back();
+                m.shape = shape;
+                m.size = size;
+                m.pass = pass;
+                count_function(*module, m);
+
+                Array<f64> times;
+                for (u32 i = 0; i < std::max(1u, (u32)repetitions); ++i) {
+                    times.push_back(time_pass(*module, pass, TM.get()));
+                }
+                llvm::sort(times);
+                m.min_ns = times.front();
+                m.median_ns = times[times.size() / 2];
+
+                errs() << format("%-12s %6u %-16s %16.0f ns %14.1f ns/block", shape.c_str(), size, pass.c_str(),
+                                 m.min_ns, m.min_ns / m.blocks);
+                if (m.loops) errs() << format(" %14.1f ns/loop", m.min_ns / m.loops);
+                errs() << "\n";
+            }
+        }
+    }
+
+    std::error_code error;
+    ToolOutputFile output(output_file, error, sys::fs::OF_Text);
+    if (error) {
+        errs() << "custom-bench: " << error.message() << "\n";
+        return 1;
+    }
+    write_json(output.os(), measurements);
+    output.keep();
+    return 0;
+}
@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""Runtime speedup of LoopFusion on tests/loop_fusion_*.c.
+
+Every test is compiled twice, with -passes='function(LoopFusion),default<O2>' and with
+-passes='default<O2>' only, and linked against a generated driver that runs each doitN
+on large arrays. The harness checks that both builds compute the same results and reports
+the best wall time and cycles per element of each function. It fails if the fused
+build is wrong or slower than -max-slowdown.
+"""
+
+import argparse
+import collections
+import json
+import os
+import re
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+
+SIGNATURE = re.compile(r"^(int|void)\s+(doit\d+)\s*\(([^)]*)\)\s*\{", re.MULTILINE)
+
+DRIVER_PRELUDE = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_readcyclecounter)
+#define HAVE_READCYCLECOUNTER 1
+#endif
+#endif
+
+#if !defined(HAVE_READCYCLECOUNTER) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+static uint64_t cycles(void) {
+#if defined(HAVE_READCYCLECOUNTER)
+    return __builtin_readcyclecounter();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/* Small values, so the arithmetic of the tests does not overflow right away. */
+static void fill(int *array, int seed) {
+    for (long i = 0; i < ELEMENTS; ++i) {
+        array[i] = (int)((i * 2654435761u + (unsigned)seed * 40503u) % 1024u) - 512;
+    }
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 1099511628211u;
+}
+
+static uint64_t checksum(int **arrays, int count, uint64_t result) {
+    uint64_t hash = mix(14695981039346656037u, result);
+    for (int k = 0; k < count; ++k) {
+        for (long i = 0; i < ELEMENTS; ++i) hash = mix(hash, (uint32_t)arrays[k][i]);
+    }
+    return hash;
+}
+"""
+
+DRIVER_FUNCTION = r"""
+static void run_{name}(int **arrays) {{
+    uint64_t best_ns = UINT64_MAX, best_cycles = UINT64_MAX, hash = 0;
+    for (int run = 0; run < RUNS; ++run) {{
+        for (int k = 0; k < {arrays}; ++k) fill(arrays[k], k);
+        uint64_t start_ns = now_ns(), start_cycles = cycles();
+        {call}
+        uint64_t end_cycles = cycles(), end_ns = now_ns();
+        if (end_ns - start_ns < best_ns) best_ns = end_ns - start_ns;
+        if (end_cycles - start_cycles < best_cycles) best_cycles = end_cycles - start_cycles;
+        if (run == 0) hash = checksum(arrays, {arrays}, (uint64_t)(int64_t)result);
+    }}
+    printf("{name} %llu %llu %016llx\n", (unsigned long long)best_ns, (unsigned long long)best_cycles,
+           (unsigned long long)hash);
+}}
+"""
+
+
+def parse_functions(source):
+    """(name, returns int, parameters) of every doitN that only takes int arrays and int counts."""
+    functions = []
+    for match in SIGNATURE.finditer(source):
+        returns, name, parameters = match.groups()
+        kinds = []
+        for parameter in parameters.split(","):
+            parameter = " ".join(parameter.split())
+            if re.fullmatch(r"int\s*\*\s*\w+", parameter):
+                kinds.append("array")
+            elif re.fullmatch(r"int\s+\w+", parameter):
+                kinds.append("count")
+            else:
+                kinds = None
+                break
+        if kinds is not None:
+            functions.append((name, returns == "int", kinds, match.group(0)[:-1].strip()))
+    return functions
+
+
+def generate_driver(functions, elements, runs):
+    parts = [f"#define ELEMENTS {elements}L\n#define RUNS {runs}\n", DRIVER_PRELUDE]
+    max_arrays = max([kinds.count("array") for _, _, kinds, _ in functions] + [1])
+    for name, returns_int, kinds, prototype in functions:
+        parts.append(prototype + ";\n")
+        arguments, array = [], 0
+        for kind in kinds:
+            if kind == "array":
+                arguments.append(f"arrays[{array}]")
+                array += 1
+            else:
+                arguments.append("(int)ELEMENTS")
+        call = f"{name}({', '.join(arguments)});"
+        call = ("int result = " if returns_int else "int result = 0; ") + call
+        parts.append(DRIVER_FUNCTION.format(name=name, arrays=array, call=call))
+
+    parts.append("\nint main(void) {\n")
+    parts.append(f"    int *arrays[{max_arrays}];\n")
+    parts.append(f"    for (int k = 0; k < {max_arrays}; ++k) arrays[k] = malloc(ELEMENTS * sizeof(int));\n")
+    for name, _, _, _ in functions:
+        parts.append(f"    run_{name}(arrays);\n")
+    parts.append("    return 0;\n}\n")
+    return "".join(parts)
+
+
+def run(command, **kwargs):
+    result = subprocess.run(command, capture_output=True, text=True, **kwargs)
+    if result.returncode < 0:
+        sys.exit(f"fusion_speedup: {' '.join(command)} was killed by signal {-result.returncode}, "
+                 f"the stack limit may be too small for -elements\n{result.stderr}")
+    if result.returncode != 0:
+        sys.exit(f"fusion_speedup: {' '.join(command)} failed:\n{result.stderr}")
+    return result
+
+
+def raise_stack_limit():
+    """Some tests keep temporary arrays of -elements ints on the stack as VLAs,
+    the binaries run with the hard stack limit instead of the usual 8 MB."""
+    _, hard = resource.getrlimit(resource.RLIMIT_STACK)
+    resource.setrlimit(resource.RLIMIT_STACK, (hard, hard))
+
+
+def find_tool(name, llvm_bin):
+    if llvm_bin:
+        path = os.path.join(llvm_bin, name)
+        if os.access(path, os.X_OK):
+            return path
+    path = shutil.which(name)
+    if not path:
+        sys.exit(f"fusion_speedup: {name} not found, pass -llvm-bin")
+    return path
+
+
+def build(tools, args, source, driver, work, fused):
+    """Compiles the test with or without LoopFusion and links it with the driver, returns the binary
+    and the number of fusions LoopFusion reported per function."""
+    variant = "fused" if fused else "plain"
+    base = os.path.join(work, "base.ll")
+    optimized = os.path.join(work, f"{variant}.bc")
+    obj = os.path.join(work, f"{variant}.o")
+    binary = os.path.join(work, variant)
+    records = os.path.join(work, f"{variant}.jsonl")
+
+    # Signed overflow in the arithmetic of the tests would make the checksums of both builds undefined.
+    if not os.path.exists(base):
+        run([tools["clang"], "-O0", "-Xclang", "-disable-O0-optnone", "-fno-discard-value-names", "-fwrapv",
+             "-S", "-emit-llvm", source, "-o", base])
+
+    pipeline = f"default<O{args.opt_level}>"
+    command = [tools["opt"]]
+    if fused:
+        pipeline = f"function(LoopFusion),{pipeline}"
+        command += ["-load", args.plugin, "-load-pass-plugin", args.plugin, f"-custom-passes-output={records}"]
+    run(command + [f"-passes={pipeline}", base, "-o", optimized])
+
+    # The plugin only creates the file for the first record.
+    fusions = collections.Counter()
+    if fused and os.path.exists(records):
+        with open(records) as file:
+            for line in file:
+                record = json.loads(line)
+                if record["pass"] == "LoopFusion":
+                    fusions[record["function"]] += 1
+
+    run([tools["clang"], f"-O{args.opt_level}", "-c", optimized, "-o", obj])
+    run([tools["clang"], f"-O{args.opt_level}", driver, obj, "-o", binary, "-lm"])
+    return binary, fusions
+
+
+def measure(binary):
+    results = {}
+    for line in run([binary], preexec_fn=raise_stack_limit).stdout.splitlines():
+        name, ns, cycles, checksum = line.split()
+        results[name] = (int(ns), int(cycles), checksum)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("tests", nargs="*", help="test files or directories, tests/ by default")
+    parser.add_argument("-plugin", required=True, help="libCustomPasses.so")
+    parser.add_argument("-llvm-bin", help="directory of clang and opt, PATH otherwise")
+    parser.add_argument("-opt-level", default="2", choices=["1", "2", "3"])
+    parser.add_argument("-elements", type=int, default=1 << 22, help="array size and trip count")
+    parser.add_argument("-runs", type=int, default=5, help="runs per function, the best one is reported")
+    parser.add_argument("-max-slowdown", type=float, default=0.10,
+                        help="fail if a fused function is slower by more than this fraction")
+    parser.add_argument("-json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    tools = {name: find_tool(name, args.llvm_bin) for name in ("clang", "opt")}
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    inputs = args.tests or [os.path.join(here, "..", "tests")]
+    sources = []
+    for path in inputs:
+        if os.path.isdir(path):
+            sources += sorted(os.path.join(path, name) for name in os.listdir(path)
+                              if name.startswith("loop_fusion_") and name.endswith(".c"))
+        else:
+            sources.append(path)
+
+    records = []
+    failed = False
+    print(f"{'test':<40} {'function':<8} {'fusions':>7} {'plain ns':>12} {'fused ns':>12} {'speedup':>8} "
+          f"{'plain c/e':>10} {'fused c/e':>10}  result")
+    for source in sources:
+        with open(source) as file:
+            functions = parse_functions(file.read())
+        if not functions:
+            continue
+
+        with tempfile.TemporaryDirectory() as work:
+            driver = os.path.join(work, "driver.c")
+            with open(driver, "w") as file:
+                file.write(generate_driver(functions, args.elements, args.runs))
+
+            plain_binary, _ = build(tools, args, source, driver, work, fused=False)
+            fused_binary, fusions = build(tools, args, source, driver, work, fused=True)
+            plain = measure(plain_binary)
+            fused = measure(fused_binary)
+
+        test = os.path.basename(source)
+        for name, _, _, _ in functions:
+            plain_ns, plain_cycles, plain_checksum = plain[name]
+            fused_ns, fused_cycles, fused_checksum = fused[name]
+            speedup = plain_ns / max(fused_ns, 1)
+
+            result = "ok"
+            if plain_checksum != fused_checksum:
+                result = "MISMATCH"
+            elif speedup < 1 / (1 + args.max_slowdown):
+                result = "SLOWER"
+            failed |= result != "ok"
+
+            print(f"{test:<40} {name:<8} {fusions[name]:>7} {plain_ns:>12} {fused_ns:>12} {speedup:>7.2f}x "
+                  f"{plain_cycles / args.elements:>10.2f} {fused_cycles / args.elements:>10.2f}  {result}")
+            records.append({
+                "test": test, "function": name, "fusions": fusions[name],
+                "plain_ns": plain_ns, "fused_ns": fused_ns, "speedup": speedup,
+                "plain_cycles_per_element": plain_cycles / args.elements,
+                "fused_cycles_per_element": fused_cycles / args.elements,
+                "result": result,
+            })
+
+    if args.json:
+        with open(args.json, "w") as file:
+            json.dump({"elements": args.elements, "runs": args.runs, "opt_level": args.opt_level,
+                       "results": records}, file, indent=2)
+            file.write("\n")
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,143 @@
+/* Runtime of the LoopProfile pass, linked into the instrumented program (libLoopProfileRuntime.a).
+ * Every thread has its own table of counters per instrumented module, so the increments in the loops
+ * are plain loads and stores that never share a cache line with another thread.
+ * The tables of a thread are added to the totals when it exits, the totals are written at program exit
+ * to $LOOP_PROFILE_FILE (loop-profile.csv by default, - for stderr). */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+
+/* Layouts of the descriptors the pass emits. */
+struct LoopProfileLoop {
+    const char *function;
+    const char *header;
+    uint32_t depth;
+    uint32_t line;
+};
+
+struct LoopProfileModule {
+    uint32_t loop_count;
+    uint32_t id;
+    const LoopProfileLoop *loops;
+};
+
+/* In the order of LoopCounter in src/LoopProfile.cpp. */
+struct LoopCounters {
+    uint64_t entries;
+    uint64_t iterations;
+    uint64_t cycles;
+};
+
+constexpr size_t CACHE_LINE = 64;
+
+struct Registry {
+    std::mutex lock;
+    std::vector<LoopProfileModule *> modules;
+    /* Counters of the threads that already exited, per module. */
+    std::vector<std::vector<LoopCounters>> totals;
+
+    ~Registry() { write(); }
+
+    void write(void);
+};
+
+/* Constructed by the first module constructor, so it is destroyed after the other static objects
+ * and after the thread-local tables of the main thread were added to it. */
+Registry &registry(void) {
+    static Registry registry;
+    return registry;
+}
+
+/* Tables of one thread, the counters of each module are padded to whole cache lines. */
+struct ThreadTables {
+    std::vector<LoopCounters *> modules;
+
+    ~ThreadTables() {
+        Registry &registry = ::registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (size_t id = 0; id < modules.size(); ++id) {
+            if (!modules[id]) continue;
+
+            std::vector<LoopCounters> &totals = registry.totals[id];
+            for (size_t loop = 0; loop < totals.size(); ++loop) {
+                totals[loop].entries += modules[id][loop].entries;
+                totals[loop].iterations += modules[id][loop].iterations;
+                totals[loop].cycles += modules[id][loop].cycles;
+            }
+            ::operator delete(modules[id], std::align_val_t(CACHE_LINE));
+        }
+        /* Loops run by static destructors after this are not counted. */
+        modules.clear();
+    }
+};
+
+thread_local ThreadTables thread_tables;
+
+LoopCounters *allocate_counters(LoopProfileModule *module) {
+    size_t size = (module->loop_count * sizeof(LoopCounters) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    auto *counters = static_cast<LoopCounters *>(::operator new(size, std::align_val_t(CACHE_LINE)));
+    memset(counters, 0, size);
+
+    if (thread_tables.modules.size() <= module->id) thread_tables.modules.resize(module->id + 1);
+    thread_tables.modules[module->id] = counters;
+    return counters;
+}
+
+void Registry::write(void) {
+    const char *path = getenv("LOOP_PROFILE_FILE");
+    if (!path) path = "loop-profile.csv";
+
+    FILE *file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "loop-profile: can not open %s\n", path);
+        return;
+    }
+
+    fprintf(file, "function,header,line,depth,entries,iterations,average_iterations,cycles,cycles_per_iteration\n");
+    for (size_t id = 0; id < modules.size(); ++id) {
+        for (uint32_t loop = 0; loop < modules[id]->loop_count; ++loop) {
+            const LoopProfileLoop &info = modules[id]->loops[loop];
+            const LoopCounters &counters = totals[id][loop];
+            if (!counters.entries && !counters.iterations) continue;
+
+            double average = counters.entries ? (double)counters.iterations / counters.entries : 0;
+            fprintf(file, "%s,%s,%u,%u,%llu,%llu,%.2f,", info.function, info.header, info.line, info.depth,
+                    (unsigned long long)counters.entries, (unsigned long long)counters.iterations, average);
+
+            /* Cycles are only taken around whole nests. */
+            if (info.depth == 1) {
+                double per_iteration = counters.iterations ? (double)counters.cycles / counters.iterations : 0;
+                fprintf(file, "%llu,%.2f\n", (unsigned long long)counters.cycles, per_iteration);
+            } else {
+                fprintf(file, ",\n");
+            }
+        }
+    }
+
+    if (file != stderr) fclose(file);
+}
+
+}  // namespace
+
+extern "C" void __loop_profile_register(LoopProfileModule *module) {
+    Registry &registry = ::registry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    module->id = registry.modules.size();
+    registry.modules.push_back(module);
+    registry.totals.emplace_back(module->loop_count);
+}
+
+/* Called once per entry of a loop nest, only the first call of a thread for a module allocates. */
+extern "C" uint64_t *__loop_profile_counters(LoopProfileModule *module) {
+    std::vector<LoopCounters *> &modules = thread_tables.modules;
+    LoopCounters *counters = module->id < modules.size() ? modules[module->id] : nullptr;
+    if (!counters) counters = allocate_counters(module);
+    return &counters->entries;
+}
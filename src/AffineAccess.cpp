@@ -0,0 +1,481 @@
+#include "AffineAccess.hpp"
+
+#include <numeric>
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.hpp"
+#include "Output.hpp"
+
+using namespace llvm;
+
+AnalysisKey AffineAccessAnalysis::Key;
+
+namespace {
+
+s64 find_level(const AffineAccess &access, const Loop *loop) {
+    for (auto [level, candidate] : enumerate(access.loops)) {
+        if (candidate == loop) return level;
+    }
+    return -1;
+}
+
+/* Splits an address offset into the recurrences of the enclosing loops
+ * and the terms that do not change inside of the loop nest. */
+bool decompose(const SCEV *expr, AffineAccess &access, Array<const SCEV *> &rest, ScalarEvolution &SE) {
+    if (auto *add_rec = dyn_cast<SCEVAddRecExpr>(expr)) {
+        if (!add_rec->isAffine()) return false;
+
+        auto *step = dyn_cast<SCEVConstant>(add_rec->getStepRecurrence(SE));
+        if (!step || step->getAPInt().getSignificantBits() > 64) return false;
+
+        s64 level = find_level(access, add_rec->getLoop());
+        if (level < 0) return false;
+
+        access.coefficients[level] += step->getAPInt().getSExtValue();
+        return decompose(add_rec->getStart(), access, rest, SE);
+    }
+
+    if (auto *add = dyn_cast<SCEVAddExpr>(expr)) {
+        for (const SCEV *op : add->operands()) {
+            if (!decompose(op, access, rest, SE)) return false;
+        }
+        return true;
+    }
+
+    if (access.loops.size() && !SE.isLoopInvariant(expr, access.loops.front())) return false;
+
+    rest.push_back(expr);
+    return true;
+}
+
+s64 floor_div(s64 a, s64 b) {
+    s64 q = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+s64 ceil_div(s64 a, s64 b) {
+    s64 q = a / b;
+    return (a % b != 0 && ((a < 0) == (b < 0))) ? q + 1 : q;
+}
+
+/* Adds the range of coefficient * [0, max_iteration] to [lo, hi].
+ * Unknown bounds and overflows make the corresponding side unbounded. */
+void add_term_bounds(s64 coefficient, s64 max_iteration, s64 &lo, bool &lo_known, s64 &hi, bool &hi_known) {
+    if (coefficient == 0) return;
+
+    s64 extreme;
+    bool known = max_iteration >= 0 && !MulOverflow(coefficient, max_iteration, extreme);
+
+    if (coefficient > 0) {
+        hi_known = hi_known && known && !AddOverflow(hi, extreme, hi);
+    } else {
+        lo_known = lo_known && known && !AddOverflow(lo, extreme, lo);
+    }
+}
+
+/* Bound of sum(|coefficients[m]| * max_iterations[m]) for m > level,
+ * which is how far the inner levels can move an address. */
+bool inner_span(const AffineAccess &access, u32 level, u32 levels, s64 &span) {
+    span = 0;
+    for (u32 m = level + 1; m < levels; ++m) {
+        s64 coefficient = access.coefficients[m];
+        if (coefficient == 0) continue;
+
+        s64 reach;
+        if (access.max_iterations[m] < 0) return false;
+        if (MulOverflow(coefficient < 0 ? -coefficient : coefficient, access.max_iterations[m], reach)) return false;
+        if (AddOverflow(span, reach, span)) return false;
+    }
+    return true;
+}
+
+/* Whether both bases are known distinct objects, such as allocas, globals or noalias arguments.
+ * Other pointers, like two plain arguments, may point into the same memory. */
+bool distinct_objects(const SCEV *base1, const SCEV *base2) {
+    auto *unknown1 = dyn_cast<SCEVUnknown>(base1);
+    auto *unknown2 = dyn_cast<SCEVUnknown>(base2);
+    if (!unknown1 || !unknown2) return false;
+
+    const Value *object1 = getUnderlyingObject(unknown1->getValue());
+    const Value *object2 = getUnderlyingObject(unknown2->getValue());
+    return object1 != object2 && isIdentifiedObject(object1) && isIdentifiedObject(object2);
+}
+
+/* GCD test for accesses of size bytes: an overlap needs
+ *     sum(coefficients * iterations) = delta + e,  -size < e < size
+ * to have integer solutions, i.e. some value in that window has to be a multiple of the gcd. */
+bool gcd_excludes(u64 gcd, s64 delta, u64 size) {
+    u64 magnitude = (u64)(delta < 0 ? -delta : delta);
+    if (gcd == 0) return magnitude >= size;
+    if (2 * size - 1 >= gcd) return false;
+
+    u64 remainder = magnitude % gcd;
+    return remainder >= size && gcd - remainder >= size;
+}
+
+}  // namespace
+
+bool get_affine_access(AffineAccess &access, Instruction &instr, ScalarEvolution &SE, LoopInfo &LI) {
+    access.instr = &instr;
+    access.is_write = isa<StoreInst>(instr);
+    access.is_affine = false;
+
+    Value *pointer = getLoadStorePointerOperand(&instr);
+    if (!pointer) return false;
+
+    for (Loop *loop = LI.getLoopFor(instr.getParent()); loop; loop = loop->getParentLoop()) {
+        access.loops.push_back(loop);
+    }
+    std::reverse(std::begin(access.loops), std::end(access.loops));
+
+    access.coefficients.assign(access.loops.size(), 0);
+    for (Loop *loop : access.loops) {
+        auto *max = dyn_cast<SCEVConstant>(SE.getConstantMaxBackedgeTakenCount(loop));
+        if (max && max->getAPInt().isNonNegative() && max->getAPInt().getActiveBits() < 64) {
+            access.max_iterations.push_back((s64)max->getAPInt().getZExtValue());
+        } else {
+            access.max_iterations.push_back(-1);
+        }
+    }
+
+    TypeSize size = instr.getModule()->getDataLayout().getTypeStoreSize(getLoadStoreType(&instr));
+    access.size = size.isScalable() ? 0 : size.getFixedValue();
+
+    if (!SE.isSCEVable(pointer->getType())) return false;
+
+    const SCEV *address = SE.getSCEV(pointer);
+    access.base = SE.getPointerBase(address);
+
+    const SCEV *offset = SE.getMinusSCEV(address, access.base);
+    if (isa<SCEVCouldNotCompute>(offset)) return false;
+
+    Array<const SCEV *> rest;
+    if (!decompose(offset, access, rest, SE)) return false;
+
+    access.offset = rest.size() ? SE.getAddExpr(rest) : SE.getZero(offset->getType());
+    access.is_affine = true;
+    return true;
+}
+
+u32 common_loop_depth(const AffineAccess &src, const AffineAccess &dst) {
+    u32 depth = 0;
+    while (depth < src.loops.size() && depth < dst.loops.size() && src.loops[depth] == dst.loops[depth]) {
+        ++depth;
+    }
+    return depth;
+}
+
+AccessDependence compute_dependence(
+    const AffineAccess &src, const AffineAccess &dst, u32 common_levels, ScalarEvolution &SE
+) {
+    AccessDependence dep;
+    dep.distance.resize(common_levels);
+
+    if (!src.is_write && !dst.is_write) {
+        dep.kind = AccessDependence::DEP_NONE;
+        dep.reason = "read after read";
+        return dep;
+    }
+
+    if (!src.is_affine || !dst.is_affine) {
+        dep.kind = AccessDependence::DEP_UNKNOWN;
+        dep.reason = "not affine";
+        return dep;
+    }
+
+    if (src.base != dst.base) {
+        if (distinct_objects(src.base, dst.base)) {
+            dep.kind = AccessDependence::DEP_NONE;
+            dep.reason = "different base";
+        } else {
+            dep.kind = AccessDependence::DEP_UNKNOWN;
+            dep.reason = "bases may alias";
+        }
+        return dep;
+    }
+
+    /* Offsets are compared as addresses of whole elements, which needs the same size on both sides. */
+    if (src.size == 0 || src.size != dst.size) {
+        dep.kind = AccessDependence::DEP_UNKNOWN;
+        dep.reason = "access sizes differ";
+        return dep;
+    }
+
+    if (src.offset->getType() != dst.offset->getType()) {
+        dep.kind = AccessDependence::DEP_UNKNOWN;
+        dep.reason = "offset types differ";
+        return dep;
+    }
+
+    auto *delta_expr = dyn_cast<SCEVConstant>(SE.getMinusSCEV(dst.offset, src.offset));
+    if (!delta_expr || delta_expr->getAPInt().getSignificantBits() > 64) {
+        dep.kind = AccessDependence::DEP_UNKNOWN;
+        dep.reason = "symbolic offset";
+        return dep;
+    }
+
+    /* Both accesses start at the same address when
+     *     sum(src.coefficients[k] * i_k) - sum(dst.coefficients[k] * j_k) = delta
+     * and overlap when the difference of the addresses is within the size. */
+    s64 delta = delta_expr->getAPInt().getSExtValue();
+    u64 size = src.size;
+
+    /* GCD test: the equation has integer solutions only if
+     * the gcd of all the coefficients divides delta. */
+    u64 gcd = 0;
+    for (s64 coefficient : src.coefficients) gcd = std::gcd(gcd, (u64)(coefficient < 0 ? -coefficient : coefficient));
+    for (s64 coefficient : dst.coefficients) gcd = std::gcd(gcd, (u64)(coefficient < 0 ? -coefficient : coefficient));
+
+    if (gcd_excludes(gcd, delta, size)) {
+        dep.kind = AccessDependence::DEP_NONE;
+        dep.reason = "GCD";
+        return dep;
+    }
+
+    /* Banerjee test: delta has to be reachable within the iteration space. */
+    s64 lo = 0, hi = 0;
+    bool lo_known = true, hi_known = true;
+    for (auto [level, coefficient] : enumerate(src.coefficients)) {
+        add_term_bounds(coefficient, src.max_iterations[level], lo, lo_known, hi, hi_known);
+    }
+    for (auto [level, coefficient] : enumerate(dst.coefficients)) {
+        add_term_bounds(-coefficient, dst.max_iterations[level], lo, lo_known, hi, hi_known);
+    }
+
+    s64 reach = (s64)size - 1;
+    if ((lo_known && delta < lo - reach) || (hi_known && delta > hi + reach)) {
+        dep.kind = AccessDependence::DEP_NONE;
+        dep.reason = "Banerjee";
+        return dep;
+    }
+
+    dep.kind = AccessDependence::DEP_DISTANCE;
+
+    /* When every address of both accesses is a multiple of the size apart,
+     * overlapping accesses start at the same address, otherwise they can also overlap partially. */
+    if (gcd % size != 0 || (u64)(delta < 0 ? -delta : delta) % size != 0) {
+        dep.reason = "unaligned";
+        return dep;
+    }
+
+    /* Exact distances exist only for uniform dependences,
+     * where the same loop scales the address the same way in both accesses. */
+    for (u32 level = 0; level < src.coefficients.size() || level < dst.coefficients.size(); ++level) {
+        s64 a = level < src.coefficients.size() ? src.coefficients[level] : 0;
+        s64 b = level < dst.coefficients.size() ? dst.coefficients[level] : 0;
+        if ((level < common_levels && a != b) || (level >= common_levels && (a != 0 || b != 0))) {
+            dep.reason = "non-uniform";
+            return dep;
+        }
+    }
+
+    /* With j_k = i_k + d_k the equation turns into sum(coefficients[k] * d_k) = -delta.
+     * Solve it level by level from the outermost loop, a level is exact
+     * if only a single distance keeps the rest within reach of the inner levels. */
+    s64 remainder = -delta;
+    for (u32 level = 0; level < common_levels; ++level) {
+        s64 a = src.coefficients[level];
+        if (a == 0) continue;
+
+        s64 span;
+        if (!inner_span(src, level, common_levels, span)) {
+            dep.reason = "unbounded inner loop";
+            return dep;
+        }
+
+        s64 lo_q, hi_q;
+        if (a > 0) {
+            lo_q = ceil_div(remainder - span, a);
+            hi_q = floor_div(remainder + span, a);
+        } else {
+            lo_q = ceil_div(remainder + span, a);
+            hi_q = floor_div(remainder - span, a);
+        }
+
+        s64 max_iteration = src.max_iterations[level];
+        if (max_iteration >= 0) {
+            lo_q = std::max(lo_q, -max_iteration);
+            hi_q = std::min(hi_q, max_iteration);
+        }
+
+        if (lo_q > hi_q) {
+            dep.kind = AccessDependence::DEP_NONE;
+            dep.reason = "distance";
+            dep.distance.clear();
+            dep.distance.resize(common_levels);
+            return dep;
+        }
+
+        if (lo_q != hi_q) {
+            dep.reason = "ambiguous distance";
+            return dep;
+        }
+
+        dep.distance[level] = lo_q;
+        remainder -= a * lo_q;
+    }
+
+    if (remainder != 0) {
+        dep.kind = AccessDependence::DEP_NONE;
+        dep.reason = "distance";
+        dep.distance.clear();
+        dep.distance.resize(common_levels);
+    }
+
+    return dep;
+}
+
+void print_dependence(raw_ostream &os, const AccessDependence &dep) {
+    if (dep.kind == AccessDependence::DEP_NONE) {
+        os << "independent (" << dep.reason << ")";
+        return;
+    }
+
+    os << "distance (";
+    for (auto [level, component] : enumerate(dep.distance)) {
+        if (level) os << ", ";
+        if (component) {
+            os << *component;
+        } else {
+            os << "*";
+        }
+    }
+    os << ")";
+
+    if (dep.reason[0]) {
+        os << " " << dep.reason;
+    }
+}
+
+bool AffineAccessInfo::invalidate(
+    Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv
+) {
+    auto checker = PA.getChecker<AffineAccessAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<ScalarEvolutionAnalysis>(func, PA)
+        || inv.invalidate<LoopAnalysis>(func, PA);
+}
+
+AffineAccessInfo AffineAccessAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+
+    AffineAccessInfo info;
+
+    for (auto &bb : func) {
+        if (!LA.getLoopFor(&bb)) continue;
+
+        for (auto &instr : bb) {
+            if (!isa<LoadInst>(instr) && !isa<StoreInst>(instr)) continue;
+
+            AffineAccess access;
+            get_affine_access(access, instr, SE, LA);
+            info.accesses.push_back(std::move(access));
+        }
+    }
+
+    for (u32 i = 0; i < info.accesses.size(); ++i) {
+        for (u32 j = i + 1; j < info.accesses.size(); ++j) {
+            auto &src = info.accesses[i];
+            auto &dst = info.accesses[j];
+
+            /* Accesses from different loop nests are ordered by the control flow. */
+            u32 depth = common_loop_depth(src, dst);
+            if (depth == 0) continue;
+
+            info.dependences.push_back({i, j, compute_dependence(src, dst, depth, SE)});
+        }
+    }
+
+    return info;
+}
+
+namespace {
+
+struct PrintedDependence {
+    const AccessDependence &dep;
+};
+
+raw_ostream &operator<<(raw_ostream &os, const PrintedDependence &printed) {
+    print_dependence(os, printed.dep);
+    return os;
+}
+
+struct AffineAccessPrintPass : PassInfoMixin<AffineAccessPrintPass> {
+    static bool isRequired(void) { return true; }
+
+    void emit_records(Function &func, const AffineAccessInfo &info) {
+        for (auto [id, access] : enumerate(info.accesses)) {
+            Record record("AffineAccess", func);
+            record.add("access", id).add("write", access.is_write).add("affine", access.is_affine);
+            if (access.is_affine) {
+                record.add_printed("base", *access.base).add_printed("offset", *access.offset);
+            }
+            emit(record);
+        }
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("AffineAccess", func.getName());
+        out() << "\n[AffineAccess]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &info = AM.getResult<AffineAccessAnalysis>(func);
+
+        if (has_result_sink()) {
+            emit_records(func, info);
+            for (auto &[src, dst, dep] : info.dependences) {
+                emit(Record("AffineAccess", func)
+                    .add("src", src)
+                    .add("dst", dst)
+                    .add("dependent", dep.kind != AccessDependence::DEP_NONE)
+                    .add_printed("dependence", PrintedDependence{dep}));
+            }
+            return PreservedAnalyses::all();
+        }
+
+        for (auto [id, access] : enumerate(info.accesses)) {
+            out() << "  Access " << id << ":" << *access.instr << "\n";
+            if (!access.is_affine) {
+                out() << "    Not affine\n";
+                continue;
+            }
+
+            out() << "    Base: " << *access.base << ", offset: " << *access.offset << ", coefficients: (";
+            for (auto [level, coefficient] : enumerate(access.coefficients)) {
+                if (level) out() << ", ";
+                out() << coefficient;
+            }
+            out() << ")\n";
+        }
+
+        for (auto &[src, dst, dep] : info.dependences) {
+            out() << "  Dependence " << src << " -> " << dst << ": ";
+            print_dependence(out(), dep);
+            out() << "\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_affine_access_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "AffineAccess") {
+        add_cacheable_pass(FPM, "AffineAccess", AffineAccessPrintPass());
+        return true;
+    }
+    return false;
+}
+
+void register_affine_access_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return AffineAccessAnalysis(); });
+}
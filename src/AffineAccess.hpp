@@ -0,0 +1,84 @@
+#pragma once
+
+#include <optional>
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* A load or store whose address is an affine function of the enclosing
+ * induction variables:
+ *     address = base + offset + sum(coefficients[k] * iteration_k)
+ * where iteration_k is the normalized iteration number (0, 1, 2, ...)
+ * of loops[k], ordered from the outermost loop to the innermost one.
+ * Coefficients and offset are in bytes. */
+struct AffineAccess {
+    llvm::Instruction *instr = nullptr;
+    bool is_write = false;
+    bool is_affine = false;
+
+    const llvm::SCEV *base = nullptr;
+    const llvm::SCEV *offset = nullptr;
+    /* Bytes the access reads or writes from its address, 0 if not a fixed size. */
+    u64 size = 0;
+
+    Array<llvm::Loop *> loops;
+    Array<s64> coefficients;
+    /* Upper bound of iteration_k, -1 if unknown. */
+    Array<s64> max_iterations;
+};
+
+/* Distance of the dependence from src to dst, per common loop:
+ * iteration(dst) - iteration(src) for the iterations touching the same address.
+ * A missing component (std::nullopt) is the '*' direction, any distance is possible. */
+struct AccessDependence {
+    typedef enum {
+        DEP_NONE,
+        DEP_DISTANCE,
+        DEP_UNKNOWN,
+    } Kind;
+
+    Kind kind = DEP_UNKNOWN;
+    /* Which test proved independence, or why the distance is unknown. */
+    const char *reason = "";
+    Array<std::optional<s64>> distance;
+};
+
+bool get_affine_access(AffineAccess &access, llvm::Instruction &instr, llvm::ScalarEvolution &SE, llvm::LoopInfo &LI);
+
+/* Number of leading loops of src and dst that are the same loop. */
+u32 common_loop_depth(const AffineAccess &src, const AffineAccess &dst);
+
+/* Levels below common_levels are treated as the same iteration space in both accesses.
+ * This is also used for sibling loops with the same evolution, e.g. when checking fusion. */
+AccessDependence compute_dependence(
+    const AffineAccess &src, const AffineAccess &dst, u32 common_levels, llvm::ScalarEvolution &SE
+);
+
+void print_dependence(llvm::raw_ostream &os, const AccessDependence &dep);
+
+struct AffineAccessInfo {
+    Array<AffineAccess> accesses;
+    /* (src index, dst index, dependence) for every pair that may touch the same memory. */
+    Array<std::tuple<u32, u32, AccessDependence>> dependences;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct AffineAccessAnalysis : llvm::AnalysisInfoMixin<AffineAccessAnalysis> {
+    using Result = AffineAccessInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<AffineAccessAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_affine_access_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_affine_access_analysis(llvm::FunctionAnalysisManager &FAM);
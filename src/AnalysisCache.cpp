@@ -0,0 +1,406 @@
+#include "AnalysisCache.hpp"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DebugCounter.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+
+#include "Passes.hpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "analysis-cache"
+
+STATISTIC(cache_hits, "Number of pass runs replayed from the analysis cache");
+STATISTIC(cache_misses, "Number of pass runs not found in the analysis cache");
+STATISTIC(cache_stores, "Number of pass runs stored in the analysis cache");
+
+static cl::opt<std::string> analysis_cache_dir(
+    "analysis-cache-dir",
+    cl::desc("Directory that keeps the output of the analysis passes for functions that did not change"),
+    cl::value_desc("directory")
+);
+
+static bool debug_counter_set(void) {
+    DebugCounter &counters = DebugCounter::instance();
+    for (unsigned id = 1; id <= counters.getNumCounters(); ++id) {
+        if (DebugCounter::isCounterSet(id)) return true;
+    }
+    return false;
+}
+
+/* -debug-counter changes what passes do from one run to the next, the cache is not used with it. */
+bool has_analysis_cache(void) {
+    return !analysis_cache_dir.empty() && !debug_counter_set();
+}
+
+namespace {
+
+/* Serializes what can change the output of a pass on a function into a buffer that is hashed once:
+ * every name, type, flag, operand and constant of the function, the metadata attached to it except
+ * debug locations, and the attributes and properties of the functions and globals it refers to,
+ * like noreturn or memory effects of callees and the initializers of constants.
+ * Values are written in full the first time and as their number after that.
+ * Printed metadata and unnamed globals are numbered across the module, a replay can show other numbers. */
+struct FunctionHasher {
+    std::string data;
+    DenseMap<const Value *, u64> numbers;
+    DenseMap<const Metadata *, u64> metadata_numbers;
+
+    typedef enum {
+        TAG_REFERENCE,
+        TAG_VALUE,
+        TAG_NULL,
+    } Tag;
+
+    void add_int(u64 value) {
+        char bytes[sizeof(u64)];
+        support::endian::write64le(bytes, value);
+        data.append(bytes, sizeof(bytes));
+    }
+
+    void add_string(StringRef text) {
+        add_int(text.size());
+        data.append(text.data(), text.size());
+    }
+
+    void add_apint(const APInt &value) {
+        add_int(value.getBitWidth());
+        for (u32 i = 0; i < value.getNumWords(); ++i) add_int(value.getRawData()[i]);
+    }
+
+    void add_attributes(AttributeList attributes, u32 params) {
+        add_string(attributes.getFnAttrs().getAsString());
+        add_string(attributes.getRetAttrs().getAsString());
+        for (u32 i = 0; i < params; ++i) add_string(attributes.getParamAttrs(i).getAsString());
+    }
+
+    void add_type(Type *type) {
+        add_int(type->getTypeID());
+        if (auto *integer = dyn_cast<IntegerType>(type)) {
+            add_int(integer->getBitWidth());
+        } else if (auto *pointer = dyn_cast<PointerType>(type)) {
+            add_int(pointer->getAddressSpace());
+        } else if (auto *array = dyn_cast<ArrayType>(type)) {
+            add_int(array->getNumElements());
+            add_type(array->getElementType());
+        } else if (auto *vector = dyn_cast<VectorType>(type)) {
+            add_int(vector->getElementCount().getKnownMinValue());
+            add_type(vector->getElementType());
+        } else if (auto *structure = dyn_cast<StructType>(type)) {
+            add_string(structure->hasName() ? structure->getName() : "");
+            add_int(structure->isPacked());
+            add_int(structure->getNumElements());
+            for (Type *element : structure->elements()) add_type(element);
+        } else if (auto *function = dyn_cast<FunctionType>(type)) {
+            add_int(function->isVarArg());
+            add_int(function->getNumParams());
+            for (Type *param : function->params()) add_type(param);
+            add_type(function->getReturnType());
+        } else if (!type->isFloatingPointTy() && !type->isVoidTy() && !type->isLabelTy()) {
+            /* Rare types with parameters of their own, like target extension types. */
+            raw_string_ostream os(data);
+            type->print(os);
+        }
+    }
+
+    void add_metadata(const Metadata *md) {
+        if (!md) {
+            add_int(TAG_NULL);
+            return;
+        }
+        if (auto it = metadata_numbers.find(md); it != metadata_numbers.end()) {
+            add_int(TAG_REFERENCE);
+            add_int(it->second);
+            return;
+        }
+        metadata_numbers.try_emplace(md, metadata_numbers.size());
+
+        add_int(TAG_VALUE);
+        add_int(md->getMetadataID());
+        if (auto *text = dyn_cast<MDString>(md)) {
+            add_string(text->getString());
+        } else if (auto *value = dyn_cast<ValueAsMetadata>(md)) {
+            add_value(value->getValue());
+        } else if (auto *node = dyn_cast<MDNode>(md)) {
+            /* Fields of specialized nodes that are not operands, like the lines of debug info, are left out
+             * as no pass reads them, the same as debug locations. */
+            add_int(node->getNumOperands());
+            for (auto &op : node->operands()) add_metadata(op);
+        }
+    }
+
+    void add_attached_metadata(SmallVectorImpl<std::pair<unsigned, MDNode *>> &attached) {
+        for (auto [kind, node] : attached) {
+            if (kind == LLVMContext::MD_dbg) continue;
+            add_int(kind);
+            add_metadata(node);
+        }
+        add_int(TAG_NULL);
+    }
+
+    void add_global(const GlobalValue *global) {
+        add_string(global->getName());
+        add_int(global->getLinkage());
+        add_int(global->getVisibility());
+        add_int((u64)global->getUnnamedAddr());
+        add_int(global->getThreadLocalMode());
+        add_int(global->getAddressSpace());
+        add_type(global->getValueType());
+
+        if (auto *func = dyn_cast<Function>(global)) {
+            add_int(func->isDeclaration());
+            add_int(func->getCallingConv());
+            add_attributes(func->getAttributes(), func->arg_size());
+        } else if (auto *variable = dyn_cast<GlobalVariable>(global)) {
+            add_int(variable->isConstant());
+            add_int(variable->getAlign() ? variable->getAlign()->value() : 0);
+            add_string(variable->getAttributes().getAsString());
+            /* Loads from constants can be folded. */
+            bool folded = variable->isConstant() && variable->hasInitializer();
+            add_int(folded);
+            if (folded) add_value(variable->getInitializer());
+        } else if (isa<GlobalAlias>(global) || isa<GlobalIFunc>(global)) {
+            add_value(global->getOperand(0));
+        }
+    }
+
+    void add_value(const Value *value) {
+        if (auto it = numbers.find(value); it != numbers.end()) {
+            add_int(TAG_REFERENCE);
+            add_int(it->second);
+            return;
+        }
+        numbers.try_emplace(value, numbers.size());
+
+        add_int(TAG_VALUE);
+        add_int(value->getValueID());
+        add_type(value->getType());
+
+        if (auto *global = dyn_cast<GlobalValue>(value)) {
+            add_global(global);
+        } else if (auto *integer = dyn_cast<ConstantInt>(value)) {
+            add_apint(integer->getValue());
+        } else if (auto *fp = dyn_cast<ConstantFP>(value)) {
+            add_apint(fp->getValueAPF().bitcastToAPInt());
+        } else if (auto *sequence = dyn_cast<ConstantDataSequential>(value)) {
+            add_string(sequence->getRawDataValues());
+        } else if (auto *constant = dyn_cast<Constant>(value)) {
+            if (auto *expr = dyn_cast<ConstantExpr>(constant)) {
+                add_int(expr->getOpcode());
+                add_int(expr->getRawSubclassOptionalData());
+                if (expr->isCompare()) add_int(expr->getPredicate());
+                if (auto *gep = dyn_cast<GEPOperator>(expr)) add_type(gep->getSourceElementType());
+            }
+            add_int(constant->getNumOperands());
+            for (const Value *op : constant->operands()) add_value(op);
+        } else if (auto *md = dyn_cast<MetadataAsValue>(value)) {
+            add_metadata(md->getMetadata());
+        } else if (auto *assembly = dyn_cast<InlineAsm>(value)) {
+            add_string(assembly->getAsmString());
+            add_string(assembly->getConstraintString());
+            add_int(assembly->hasSideEffects());
+            add_int(assembly->isAlignStack());
+            add_int(assembly->getDialect());
+            add_int(assembly->canThrow());
+        } else if (auto *bb = dyn_cast<BasicBlock>(value)) {
+            /* Block of another function, in a blockaddress. */
+            add_string(bb->getName());
+        }
+    }
+
+    void add_instruction(const Instruction &instr) {
+        add_int(instr.getOpcode());
+        add_type(instr.getType());
+        add_string(instr.getName());
+        add_int(instr.getRawSubclassOptionalData());
+
+        if (auto *cmp = dyn_cast<CmpInst>(&instr)) {
+            add_int(cmp->getPredicate());
+        } else if (auto *load = dyn_cast<LoadInst>(&instr)) {
+            add_int(load->getAlign().value());
+            add_int(load->isVolatile());
+            add_int((u64)load->getOrdering());
+            add_int(load->getSyncScopeID());
+        } else if (auto *store = dyn_cast<StoreInst>(&instr)) {
+            add_int(store->getAlign().value());
+            add_int(store->isVolatile());
+            add_int((u64)store->getOrdering());
+            add_int(store->getSyncScopeID());
+        } else if (auto *alloca = dyn_cast<AllocaInst>(&instr)) {
+            add_type(alloca->getAllocatedType());
+            add_int(alloca->getAlign().value());
+        } else if (auto *gep = dyn_cast<GetElementPtrInst>(&instr)) {
+            add_type(gep->getSourceElementType());
+        } else if (auto *call = dyn_cast<CallBase>(&instr)) {
+            add_type(call->getFunctionType());
+            add_int(call->getCallingConv());
+            add_attributes(call->getAttributes(), call->arg_size());
+            if (auto *plain_call = dyn_cast<CallInst>(call)) add_int(plain_call->getTailCallKind());
+            for (u32 i = 0; i < call->getNumOperandBundles(); ++i) {
+                add_string(call->getOperandBundleAt(i).getTagName());
+            }
+        } else if (auto *phi = dyn_cast<PHINode>(&instr)) {
+            for (const BasicBlock *bb : phi->blocks()) add_value(bb);
+        } else if (auto *shuffle = dyn_cast<ShuffleVectorInst>(&instr)) {
+            for (int element : shuffle->getShuffleMask()) add_int((u64)element);
+        } else if (auto *extract = dyn_cast<ExtractValueInst>(&instr)) {
+            for (unsigned index : extract->indices()) add_int(index);
+        } else if (auto *insert = dyn_cast<InsertValueInst>(&instr)) {
+            for (unsigned index : insert->indices()) add_int(index);
+        } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&instr)) {
+            add_int(rmw->getOperation());
+            add_int(rmw->getAlign().value());
+            add_int(rmw->isVolatile());
+            add_int((u64)rmw->getOrdering());
+            add_int(rmw->getSyncScopeID());
+        } else if (auto *cmpxchg = dyn_cast<AtomicCmpXchgInst>(&instr)) {
+            add_int(cmpxchg->getAlign().value());
+            add_int(cmpxchg->isVolatile());
+            add_int(cmpxchg->isWeak());
+            add_int((u64)cmpxchg->getSuccessOrdering());
+            add_int((u64)cmpxchg->getFailureOrdering());
+            add_int(cmpxchg->getSyncScopeID());
+        } else if (auto *fence = dyn_cast<FenceInst>(&instr)) {
+            add_int((u64)fence->getOrdering());
+            add_int(fence->getSyncScopeID());
+        } else if (auto *landing_pad = dyn_cast<LandingPadInst>(&instr)) {
+            add_int(landing_pad->isCleanup());
+        }
+
+        add_int(instr.getNumOperands());
+        for (const Value *op : instr.operands()) add_value(op);
+
+        SmallVector<std::pair<unsigned, MDNode *>, 4> attached;
+        instr.getAllMetadata(attached);
+        add_attached_metadata(attached);
+    }
+
+    void add_function(const Function &func) {
+        /* Numbered up front, instructions can use values defined further down. */
+        for (auto &arg : func.args()) numbers.try_emplace(&arg, numbers.size());
+        for (auto &bb : func) {
+            numbers.try_emplace(&bb, numbers.size());
+            for (auto &instr : bb) numbers.try_emplace(&instr, numbers.size());
+        }
+
+        add_value(&func);
+        add_string(func.getSection());
+        add_int(func.getAlign() ? func.getAlign()->value() : 0);
+        add_string(func.hasGC() ? func.getGC() : "");
+        add_int(func.hasPersonalityFn());
+        if (func.hasPersonalityFn()) add_value(func.getPersonalityFn());
+
+        SmallVector<std::pair<unsigned, MDNode *>, 4> attached;
+        func.getAllMetadata(attached);
+        add_attached_metadata(attached);
+
+        for (auto &arg : func.args()) add_string(arg.getName());
+        for (auto &bb : func) {
+            add_string(bb.getName());
+            add_int(bb.size());
+            for (auto &instr : bb) add_instruction(instr);
+        }
+    }
+};
+
+}  // namespace
+
+static u64 function_hash(const Function &func) {
+    FunctionHasher hasher;
+    hasher.add_function(func);
+    return xxHash64(hasher.data);
+}
+
+std::string analysis_cache_key(StringRef pass_name, StringRef options, const Function &func) {
+    const Module &module = *func.getParent();
+
+    std::string key;
+    raw_string_ostream os(key);
+    os << PLUGIN_VERSION << '\0'
+        << pass_name << '\0'
+        << options << '\0'
+        << module.getTargetTriple() << '\0'
+        << module.getDataLayoutStr() << '\0'
+        << output_kind() << '\0'
+        << func.getName() << '\0'
+        << utohexstr(function_hash(func));
+    return os.str();
+}
+
+/* One file per entry, named by the hash of the key. The key is stored in front of the output,
+ * so a collision of the hashes is a miss and not a wrong result:
+ *   u32 key size (little endian), key, output */
+static SmallString<128> entry_path(StringRef key) {
+    SmallString<128> path(analysis_cache_dir);
+    sys::path::append(path, utohexstr(xxHash64(key), true, 16));
+    return path;
+}
+
+bool replay_cached_output(StringRef key) {
+    /* Large entries are memory-mapped by MemoryBuffer instead of read. */
+    auto buffer = MemoryBuffer::getFile(entry_path(key), false, false);
+    if (!buffer) {
+        ++cache_misses;
+        return false;
+    }
+
+    StringRef data = (*buffer)->getBuffer();
+    if (data.size() < sizeof(u32)) {
+        ++cache_misses;
+        return false;
+    }
+    u32 key_size = support::endian::read32le(data.data());
+    data = data.drop_front(sizeof(u32));
+    if (data.size() < key_size || data.take_front(key_size) != key) {
+        ++cache_misses;
+        return false;
+    }
+
+    replay_output(data.drop_front(key_size));
+    ++cache_hits;
+    return true;
+}
+
+/* Written to a temporary file that is renamed over the entry, so concurrent runs
+ * sharing the directory never see a partial entry. */
+void store_cached_output(StringRef key, StringRef output) {
+    static bool directory_ready = !sys::fs::create_directories(analysis_cache_dir);
+    if (!directory_ready) return;
+
+    SmallString<128> path = entry_path(key);
+    SmallString<128> temporary;
+    int fd;
+    if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, temporary)) return;
+
+    {
+        raw_fd_ostream os(fd, true);
+        char key_size[sizeof(u32)];
+        support::endian::write32le(key_size, key.size());
+        os.write(key_size, sizeof(key_size));
+        os << key << output;
+        os.close();
+        if (os.has_error()) {
+            os.clear_error();
+            sys::fs::remove(temporary);
+            return;
+        }
+    }
+
+    if (sys::fs::rename(temporary, path)) {
+        sys::fs::remove(temporary);
+        return;
+    }
+    ++cache_stores;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Common.hpp"
+#include "Output.hpp"
+
+/* True if -analysis-cache-dir is given and no debug counter is set. */
+bool has_analysis_cache(void);
+
+/* Key of the output of a pass on a function: the plugin version, the pass with the options
+ * that change its output, the target, the kind of output, the name of the function and a structural
+ * hash of its IR, with the attributes of the functions and globals it refers to. */
+std::string analysis_cache_key(llvm::StringRef pass_name, llvm::StringRef options, const llvm::Function &func);
+
+/* Writes the cached output to where the pass would have written it, false if there is none. */
+bool replay_cached_output(llvm::StringRef key);
+
+void store_cached_output(llvm::StringRef key, llvm::StringRef output);
+
+/* Runs the pass only for functions whose output is not in the cache yet and replays it otherwise.
+ * Only for passes that print results, a transform would be skipped on a hit. As a safeguard,
+ * runs that changed the function are never stored. */
+template <typename Pass>
+struct CachedPass : llvm::PassInfoMixin<CachedPass<Pass>> {
+    std::string pass_name;
+    std::string options;
+    Pass pass;
+
+    CachedPass(llvm::StringRef pass_name, llvm::StringRef options, Pass pass)
+        : pass_name(pass_name), options(options), pass(std::move(pass)) {}
+
+    static bool isRequired(void) { return true; }
+
+    llvm::PreservedAnalyses run(llvm::Function &func, llvm::FunctionAnalysisManager &AM) {
+        std::string key = analysis_cache_key(pass_name, options, func);
+        if (replay_cached_output(key)) return llvm::PreservedAnalyses::all();
+
+        std::string captured;
+        llvm::PreservedAnalyses PA = [&] {
+            llvm::raw_string_ostream os(captured);
+            ScopedOutput scoped(os);
+            return pass.run(func, AM);
+        }();
+
+        replay_output(captured);
+        if (PA.areAllPreserved()) store_cached_output(key, captured);
+        return PA;
+    }
+};
+
+/* Adds the pass, behind the cache with -analysis-cache-dir. */
+template <typename Pass>
+void add_cacheable_pass(llvm::FunctionPassManager &FPM, llvm::StringRef pass_name, Pass pass, llvm::StringRef options = "") {
+    if (has_analysis_cache()) {
+        FPM.addPass(CachedPass<Pass>(pass_name, options, std::move(pass)));
+    } else {
+        FPM.addPass(std::move(pass));
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+#include "llvm/ADT/SmallVector.h"
+
+/* Signed numbers */
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+/* Unsigned numbers */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/* Floating point numbers */
+typedef float f32;
+typedef double f64;
+typedef long double f80;
+
+template <typename T>
+using Array = llvm::SmallVector<T>;
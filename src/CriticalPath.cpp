@@ -0,0 +1,219 @@
+#include "CriticalPath.hpp"
+
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.hpp"
+#include "LoopCost.hpp"
+#include "Output.hpp"
+
+using namespace llvm;
+
+AnalysisKey CriticalPathAnalysis::Key;
+
+namespace {
+
+s64 get_latency(const Instruction &instr, const TargetTransformInfo &TTI) {
+    if (isa<PHINode>(instr)) return 0;
+    return get_instruction_cost(instr, TTI, TargetTransformInfo::TCK_Latency);
+}
+
+/* Memory accesses have to stay in order unless both only read
+ * or alias analysis proves they touch different locations. */
+bool memory_dependent(const Instruction *earlier, const Instruction *later, AAResults &AA) {
+    if (!earlier->mayWriteToMemory() && !later->mayWriteToMemory()) return false;
+
+    auto earlier_loc = MemoryLocation::getOrNone(earlier);
+    auto later_loc = MemoryLocation::getOrNone(later);
+    if (!earlier_loc || !later_loc) return true;
+
+    return !AA.isNoAlias(*earlier_loc, *later_loc);
+}
+
+}  // namespace
+
+void schedule_block(BlockSchedule &schedule, BasicBlock *bb, const TargetTransformInfo &TTI, AAResults &AA) {
+    schedule.bb = bb;
+    schedule.critical_path = 0;
+    schedule.work = 0;
+
+    /* Earliest finish time of every instruction, the block is already in topological order. */
+    DenseMap<const Instruction *, s64> finish;
+    Array<const Instruction *> memops;
+
+    for (auto &instr : *bb) {
+        s64 start = 0;
+        for (Value *operand : instr.operands()) {
+            auto *def = dyn_cast<Instruction>(operand);
+            if (!def || def->getParent() != bb) continue;
+            start = std::max(start, finish.lookup(def));
+        }
+
+        if (instr.mayReadOrWriteMemory()) {
+            for (const Instruction *memop : memops) {
+                if (memory_dependent(memop, &instr, AA)) {
+                    start = std::max(start, finish.lookup(memop));
+                }
+            }
+            memops.push_back(&instr);
+        }
+
+        s64 latency = get_latency(instr, TTI);
+        finish[&instr] = start + latency;
+
+        schedule.work += latency;
+        schedule.critical_path = std::max(schedule.critical_path, start + latency);
+    }
+}
+
+void compute_recurrence(LoopRecurrence &recurrence, Loop *loop, LoopInfo &LI, const TargetTransformInfo &TTI) {
+    recurrence.loop = loop;
+    recurrence.rec_mii = 0;
+    recurrence.phi = nullptr;
+
+    BasicBlock *latch = loop->getLoopLatch();
+    if (!latch) return;
+
+    LoopBlocksRPO rpo(loop);
+    rpo.perform(&LI);
+
+    for (auto &phi : loop->getHeader()->phis()) {
+        auto *next = dyn_cast<Instruction>(phi.getIncomingValueForBlock(latch));
+        if (!next || next == &phi || !loop->contains(next)) continue;
+
+        /* Longest latency from the phi to every instruction of the same iteration that depends on it. */
+        DenseMap<const Instruction *, s64> distance;
+        distance[&phi] = 0;
+        for (BasicBlock *bb : rpo) {
+            for (auto &instr : *bb) {
+                if (&instr == &phi) continue;
+                if (bb == loop->getHeader() && isa<PHINode>(instr)) continue;
+
+                s64 longest = -1;
+                for (Value *operand : instr.operands()) {
+                    auto *def = dyn_cast<Instruction>(operand);
+                    if (!def) continue;
+
+                    auto it = distance.find(def);
+                    if (it != distance.end()) longest = std::max(longest, it->second);
+                }
+                if (longest >= 0) {
+                    distance[&instr] = longest + get_latency(instr, TTI);
+                }
+            }
+        }
+
+        auto it = distance.find(next);
+        if (it != distance.end() && it->second > recurrence.rec_mii) {
+            recurrence.rec_mii = it->second;
+            recurrence.phi = &phi;
+        }
+    }
+}
+
+const BlockSchedule *CriticalPathInfo::lookup(const BasicBlock *bb) const {
+    auto it = block_index.find(bb);
+    if (it == block_index.end()) return nullptr;
+    return &blocks[it->second];
+}
+
+const LoopRecurrence *CriticalPathInfo::lookup(const Loop *loop) const {
+    auto it = loop_index.find(loop);
+    if (it == loop_index.end()) return nullptr;
+    return &loops[it->second];
+}
+
+bool CriticalPathInfo::invalidate(Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = PA.getChecker<CriticalPathAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<LoopAnalysis>(func, PA)
+        || inv.invalidate<AAManager>(func, PA);
+}
+
+CriticalPathInfo CriticalPathAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &TTI = AM.getResult<TargetIRAnalysis>(func);
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+    auto &AA = AM.getResult<AAManager>(func);
+
+    CriticalPathInfo info;
+    for (auto &bb : func) {
+        BlockSchedule schedule;
+        schedule_block(schedule, &bb, TTI, AA);
+
+        info.block_index[&bb] = info.blocks.size();
+        info.blocks.push_back(schedule);
+    }
+
+    for (Loop *loop : LA.getLoopsInPreorder()) {
+        LoopRecurrence recurrence;
+        compute_recurrence(recurrence, loop, LA, TTI);
+
+        info.loop_index[loop] = info.loops.size();
+        info.loops.push_back(recurrence);
+    }
+
+    return info;
+}
+
+namespace {
+
+struct CriticalPathPrintPass : PassInfoMixin<CriticalPathPrintPass> {
+    static bool isRequired(void) { return true; }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("CriticalPath", func.getName());
+        out() << "\n[CriticalPath]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &info = AM.getResult<CriticalPathAnalysis>(func);
+        for (auto &schedule : info.blocks) {
+            if (has_result_sink()) {
+                emit(Record("CriticalPath", func)
+                    .add("block", schedule.bb->getName())
+                    .add("critical_path", schedule.critical_path)
+                    .add("work", schedule.work)
+                    .add("ilp", schedule.ilp()));
+                continue;
+            }
+
+            out() << "  Block '" << schedule.bb->getName() << "': critical path " << schedule.critical_path
+                << ", work " << schedule.work << ", ILP " << format("%.2f", schedule.ilp()) << "\n";
+        }
+
+        for (auto &recurrence : info.loops) {
+            if (has_result_sink()) {
+                Record record("CriticalPath", func);
+                record.add("loop", recurrence.loop->getName()).add("rec_mii", recurrence.rec_mii);
+                if (recurrence.phi) record.add("recurrence", recurrence.phi->getName());
+                emit(record);
+                continue;
+            }
+
+            out() << "  Loop at " << recurrence.loop->getName() << ": RecMII " << recurrence.rec_mii;
+            if (recurrence.phi) {
+                out() << " through " << recurrence.phi->getName();
+            }
+            out() << "\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_critical_path_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "CriticalPath") {
+        add_cacheable_pass(FPM, "CriticalPath", CriticalPathPrintPass());
+        return true;
+    }
+    return false;
+}
+
+void register_critical_path_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return CriticalPathAnalysis(); });
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* Longest latency chain through the data and memory dependences of a block
+ * versus the sum of all latencies, their ratio is the available ILP. */
+struct BlockSchedule {
+    llvm::BasicBlock *bb = nullptr;
+    s64 critical_path = 0;
+    s64 work = 0;
+
+    f64 ilp(void) const { return critical_path ? (f64)work / critical_path : 1; }
+};
+
+/* Recurrence constrained minimum initiation interval: the longest latency cycle
+ * from a header phi through one iteration back to its incoming value on the latch.
+ * Recurrences through memory are not considered. */
+struct LoopRecurrence {
+    llvm::Loop *loop = nullptr;
+    s64 rec_mii = 0;
+    /* Header phi of the most constraining recurrence, null if there are none. */
+    llvm::PHINode *phi = nullptr;
+};
+
+void schedule_block(
+    BlockSchedule &schedule, llvm::BasicBlock *bb, const llvm::TargetTransformInfo &TTI, llvm::AAResults &AA
+);
+
+void compute_recurrence(
+    LoopRecurrence &recurrence, llvm::Loop *loop, llvm::LoopInfo &LI, const llvm::TargetTransformInfo &TTI
+);
+
+struct CriticalPathInfo {
+    Array<BlockSchedule> blocks;
+    Array<LoopRecurrence> loops;
+    llvm::DenseMap<const llvm::BasicBlock *, u32> block_index;
+    llvm::DenseMap<const llvm::Loop *, u32> loop_index;
+
+    const BlockSchedule *lookup(const llvm::BasicBlock *bb) const;
+    const LoopRecurrence *lookup(const llvm::Loop *loop) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct CriticalPathAnalysis : llvm::AnalysisInfoMixin<CriticalPathAnalysis> {
+    using Result = CriticalPathInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<CriticalPathAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_critical_path_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_critical_path_analysis(llvm::FunctionAnalysisManager &FAM);
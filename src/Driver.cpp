@@ -0,0 +1,213 @@
+#include <optional>
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+
+#include "Output.hpp"
+#include "Passes.hpp"
+
+using namespace llvm;
+
+static cl::list<std::string> input_files(cl::Positional, cl::desc("<input .ll/.bc files>"), cl::OneOrMore);
+
+static cl::opt<std::string> pipeline(
+    "passes",
+    cl::desc("Pass pipeline, in the syntax of opt -passes"),
+    cl::Required
+);
+
+static cl::opt<std::string> output_file(
+    "o",
+    cl::desc("Write the transformed module to this file, only with a single input"),
+    cl::value_desc("filename")
+);
+
+static cl::opt<bool> output_assembly("S", cl::desc("Write the module as textual IR"), cl::init(false));
+
+static cl::opt<bool> lazy(
+    "lazy",
+    cl::desc("Load bitcode lazily and materialize one function at a time, only for function pipelines"),
+    cl::init(false)
+);
+
+static cl::opt<bool> time_trace(
+    "time-trace",
+    cl::desc("Record the time of every pass and function in the Chrome trace format (chrome://tracing, Perfetto)"),
+    cl::init(false)
+);
+
+static cl::opt<unsigned> time_trace_granularity(
+    "time-trace-granularity",
+    cl::desc("Minimum time in microseconds of a recorded event"),
+    cl::init(500)
+);
+
+static cl::opt<std::string> time_trace_file(
+    "time-trace-file",
+    cl::desc("Write the trace to this file, instead of <output or first input>.time-trace"),
+    cl::value_desc("filename")
+);
+
+static std::unique_ptr<TargetMachine> create_target_machine(Module &module) {
+    std::string triple = module.getTargetTriple();
+    if (triple.empty()) triple = sys::getDefaultTargetTriple();
+
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(triple, error);
+    if (!target) return nullptr;
+
+    return std::unique_ptr<TargetMachine>(
+        target->createTargetMachine(triple, "generic", "", TargetOptions(), std::nullopt)
+    );
+}
+
+/* Same pass managers as opt would build, with the passes of the plugin linked in.
+ * All pass output goes to stdout and is flushed after every pass,
+ * so results of a function show up as soon as it is done. */
+struct Pipeline {
+    std::unique_ptr<TargetMachine> TM;
+    PassInstrumentationCallbacks PIC;
+    std::unique_ptr<PassBuilder> PB;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    Pipeline(Module &module, raw_ostream &os) : TM(create_target_machine(module)) {
+        PIC.registerAfterPassCallback([&os](StringRef, Any, const PreservedAnalyses &) { os.flush(); });
+        PIC.registerAfterPassInvalidatedCallback([&os](StringRef, const PreservedAnalyses &) { os.flush(); });
+
+        PB = std::make_unique<PassBuilder>(TM.get(), PipelineTuningOptions(), std::nullopt, &PIC);
+        get_plugin_info().RegisterPassBuilderCallbacks(*PB);
+
+        PB->registerModuleAnalyses(MAM);
+        PB->registerCGSCCAnalyses(CGAM);
+        PB->registerFunctionAnalyses(FAM);
+        PB->registerLoopAnalyses(LAM);
+        PB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    }
+
+    template <typename PassManagerT>
+    bool parse(PassManagerT &PM) {
+        if (auto error = PB->parsePassPipeline(PM, pipeline)) {
+            errs() << "custom-opt: " << toString(std::move(error)) << "\n";
+            return false;
+        }
+        return true;
+    }
+};
+
+static bool run_pipeline(Module &module, raw_ostream &os) {
+    Pipeline passes(module, os);
+
+    ModulePassManager MPM;
+    if (!passes.parse(MPM)) return false;
+
+    MPM.run(module, passes.MAM);
+    return true;
+}
+
+/* Only the function being analyzed has a body in memory: it is materialized from the bitcode,
+ * its analyses are dropped after the pipeline and then its body is deleted.
+ * Callees are seen as declarations, so nothing interprocedural works in this mode. */
+static bool run_pipeline_lazily(Module &module, raw_ostream &os) {
+    Pipeline passes(module, os);
+
+    FunctionPassManager FPM;
+    if (!passes.parse(FPM)) return false;
+
+    for (auto &func : module) {
+        if (auto error = func.materialize()) {
+            errs() << "custom-opt: " << toString(std::move(error)) << "\n";
+            return false;
+        }
+        if (func.isDeclaration()) continue;
+
+        FPM.run(func, passes.FAM);
+        passes.FAM.clear(func, func.getName());
+        func.deleteBody();
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    InitLLVM init(argc, argv);
+    InitializeNativeTarget();
+    cl::ParseCommandLineOptions(argc, argv, "Runs the custom passes without loading a plugin\n");
+
+    if (!output_file.empty() && input_files.size() != 1) {
+        errs() << "custom-opt: -o needs exactly one input file\n";
+        return 1;
+    }
+    if (!output_file.empty() && lazy) {
+        errs() << "custom-opt: -o can not be used with -lazy, function bodies are dropped\n";
+        return 1;
+    }
+
+    /* Text goes to stdout, a result sink keeps its own file. */
+    std::optional<ScopedOutput> scoped;
+    if (!has_result_sink()) scoped.emplace(outs());
+    raw_ostream &os = output_target();
+
+    if (time_trace) {
+        timeTraceProfilerInitialize(time_trace_granularity, argv[0]);
+        set_time_trace_granularity(time_trace_granularity);
+    }
+
+    for (auto &input : input_files) {
+        TimeTraceScope time_scope("Input", input);
+
+        LLVMContext context;
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> module = lazy
+            ? getLazyIRFileModule(input, diagnostic, context)
+            : parseIRFile(input, diagnostic, context);
+        if (!module) {
+            diagnostic.print(argv[0], errs());
+            return 1;
+        }
+
+        if (!(lazy ? run_pipeline_lazily(*module, os) : run_pipeline(*module, os))) return 1;
+
+        if (!output_file.empty()) {
+            std::error_code error;
+            ToolOutputFile output(output_file, error, output_assembly ? sys::fs::OF_Text : sys::fs::OF_None);
+            if (error) {
+                errs() << "custom-opt: " << error.message() << "\n";
+                return 1;
+            }
+
+            if (output_assembly) {
+                module->print(output.os(), nullptr);
+            } else {
+                WriteBitcodeToFile(*module, output.os());
+            }
+            output.keep();
+        }
+    }
+
+    if (time_trace) {
+        Error error = timeTraceProfilerWrite(time_trace_file, output_file.empty() ? input_files[0] : output_file);
+        timeTraceProfilerCleanup();
+        if (error) {
+            logAllUnhandledErrors(std::move(error), errs(), "custom-opt: ");
+            return 1;
+        }
+    }
+
+    return 0;
+}
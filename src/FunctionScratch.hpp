@@ -0,0 +1,22 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include "Common.hpp"
+
+/* Memory that a pass only needs while it runs on one function.
+ * reset() rewinds the allocator to its first slab instead of freeing everything,
+ * so small functions reuse the same memory and a large one does not keep its slabs
+ * for the rest of the module. */
+struct FunctionScratch {
+    llvm::BumpPtrAllocator allocator;
+
+    /* Uninitialized, like resize_for_overwrite, valid until the next reset(). */
+    template <typename T>
+    llvm::MutableArrayRef<T> allocate(size_t count) {
+        return {allocator.Allocate<T>(count), count};
+    }
+
+    void reset(void) { allocator.Reset(); }
+};
@@ -0,0 +1,383 @@
+#include "FunctionSummary.hpp"
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BuildLibCalls.h"
+
+#include "Output.hpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "summary-attrs"
+
+STATISTIC(functions_changed, "Number of functions with attributes from their summary");
+
+AnalysisKey FunctionSummaryAnalysis::Key;
+
+namespace {
+
+/* Summaries of functions that may be replaced at link time say nothing about the final callee. */
+const FunctionSummary *get_callee_summary(const CallBase *call, const FunctionSummaryInfo &known) {
+    const Function *callee = call->getCalledFunction();
+    if (!callee || !callee->hasExactDefinition()) return nullptr;
+    return known.lookup(callee);
+}
+
+void add_access(MemoryEffects &effects, const Value *ptr, ModRefInfo mod_ref) {
+    if (mod_ref == ModRefInfo::NoModRef) return;
+
+    const Value *object = getUnderlyingObject(ptr);
+    if (isa<AllocaInst>(object)) return;
+
+    if (isa<Argument>(object)) {
+        effects |= MemoryEffects::argMemOnly(mod_ref);
+    } else {
+        effects |= MemoryEffects(IRMemLocation::Other, mod_ref);
+    }
+}
+
+/* Memory effects of a call as seen by the caller,
+ * argument memory of the callee is whatever the passed pointers point to. */
+void add_call_effects(MemoryEffects &effects, const CallBase *call, const FunctionSummary *callee) {
+    MemoryEffects callee_effects = callee ? callee->effects : call->getMemoryEffects();
+    effects |= callee_effects.getWithoutLoc(IRMemLocation::ArgMem);
+
+    ModRefInfo arg_mod_ref = callee_effects.getModRef(IRMemLocation::ArgMem);
+    if (arg_mod_ref == ModRefInfo::NoModRef) return;
+
+    for (auto [no, arg] : enumerate(call->args())) {
+        if (!arg->getType()->isPointerTy()) continue;
+
+        ModRefInfo mod_ref = arg_mod_ref;
+        if (callee && no < callee->args.size()) {
+            if (callee->args[no].unused) continue;
+            if (callee->args[no].read_only) mod_ref &= ModRefInfo::Ref;
+        } else {
+            if (call->doesNotAccessMemory(no)) continue;
+            if (call->onlyReadsMemory(no)) mod_ref &= ModRefInfo::Ref;
+        }
+        add_access(effects, arg, mod_ref);
+    }
+}
+
+/* Follows the pointer through address computations, any use that may write through it,
+ * or hand it to somebody who might, makes the argument writable. */
+bool only_read(const Argument &arg, const FunctionSummaryInfo &known) {
+    Array<const Use *> worklist;
+    SmallPtrSet<const Value *, 16> visited;
+    for (auto &use : arg.uses()) {
+        worklist.push_back(&use);
+    }
+
+    while (!worklist.empty()) {
+        const Use *use = worklist.pop_back_val();
+        auto *user = cast<Instruction>(use->getUser());
+
+        if (isa<LoadInst>(user) || isa<ICmpInst>(user)) continue;
+
+        if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user) || isa<AddrSpaceCastInst>(user)
+            || isa<PHINode>(user) || isa<SelectInst>(user)) {
+            if (visited.insert(user).second) {
+                for (auto &user_use : user->uses()) {
+                    worklist.push_back(&user_use);
+                }
+            }
+            continue;
+        }
+
+        if (auto *call = dyn_cast<CallBase>(user)) {
+            if (!call->isArgOperand(use)) return false;
+
+            u32 no = call->getArgOperandNo(use);
+            if (call->onlyReadsMemory(no)) continue;
+
+            const FunctionSummary *callee = get_callee_summary(call, known);
+            if (callee && no < callee->args.size() && (callee->args[no].read_only || callee->args[no].unused)) continue;
+            return false;
+        }
+
+        /* Stores, atomics and everything else that is not understood. */
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+void summarize_function(FunctionSummary &summary, Function &func, const FunctionSummaryInfo &known) {
+    summary.func = &func;
+    summary.args.clear();
+    summary.effects = MemoryEffects::none();
+    summary.no_unwind = true;
+    summary.call_sites = 0;
+    summary.callees = 0;
+    summary.size = 0;
+
+    for (auto &arg : func.args()) {
+        ArgumentSummary arg_summary;
+        arg_summary.unused = arg.use_empty();
+        if (arg.getType()->isPointerTy()) {
+            arg_summary.read_only = arg_summary.unused || only_read(arg, known);
+            arg_summary.captured = PointerMayBeCaptured(&arg, true, true);
+        } else {
+            arg_summary.captured = false;
+        }
+        summary.args.push_back(arg_summary);
+    }
+
+    SmallPtrSet<const Function *, 8> callees;
+    for (auto &bb : func) {
+        for (auto &instr : bb) {
+            summary.size++;
+
+            if (auto *call = dyn_cast<CallBase>(&instr)) {
+                const Function *called = call->getCalledFunction();
+                const FunctionSummary *callee = get_callee_summary(call, known);
+
+                if (!isa<IntrinsicInst>(call)) {
+                    summary.call_sites++;
+                    if (called) callees.insert(called);
+                }
+
+                add_call_effects(summary.effects, call, callee);
+                if (callee ? !callee->no_unwind : call->mayThrow()) {
+                    summary.no_unwind = false;
+                }
+                continue;
+            }
+
+            if (instr.mayThrow()) {
+                summary.no_unwind = false;
+            }
+            if (!instr.mayReadOrWriteMemory()) continue;
+
+            auto location = MemoryLocation::getOrNone(&instr);
+            if (!location) {
+                summary.effects = MemoryEffects::unknown();
+                continue;
+            }
+
+            ModRefInfo mod_ref = ModRefInfo::NoModRef;
+            if (instr.mayReadFromMemory()) mod_ref |= ModRefInfo::Ref;
+            if (instr.mayWriteToMemory()) mod_ref |= ModRefInfo::Mod;
+            add_access(summary.effects, location->Ptr, mod_ref);
+        }
+    }
+    summary.callees = callees.size();
+}
+
+void print_summary(raw_ostream &os, const FunctionSummary &summary) {
+    for (auto [arg, arg_summary] : zip(summary.func->args(), summary.args)) {
+        os << "    Argument " << arg.getArgNo();
+        if (arg.hasName()) os << " (" << arg.getName() << ")";
+        os << ":";
+        if (arg_summary.unused) os << " unused";
+        if (arg.getType()->isPointerTy()) {
+            if (arg_summary.read_only) os << " readonly";
+            os << (arg_summary.captured ? " captured" : " nocapture");
+        }
+        os << "\n";
+    }
+    os << "    Memory: " << summary.effects << (summary.no_unwind ? ", nounwind" : "") << "\n";
+    os << "    Calls: " << summary.call_sites << " call sites to " << summary.callees << " callees\n";
+    os << "    Size: " << summary.size << " instructions\n";
+}
+
+void emit_summary(StringRef pass, const FunctionSummary &summary) {
+    for (auto [arg, arg_summary] : zip(summary.func->args(), summary.args)) {
+        Record record(pass, *summary.func);
+        record.add("argument", arg.getArgNo()).add("unused", arg_summary.unused);
+        if (arg.getType()->isPointerTy()) {
+            record.add("readonly", arg_summary.read_only).add("captured", arg_summary.captured);
+        }
+        emit(record);
+    }
+
+    emit(Record(pass, *summary.func)
+        .add_printed("memory", summary.effects)
+        .add("nounwind", summary.no_unwind)
+        .add("call_sites", summary.call_sites)
+        .add("callees", summary.callees)
+        .add("size", summary.size));
+}
+
+void FunctionSummaryInfo::DeletionHandle::deleted() {
+    auto *func = cast<Function>(getValPtr());
+    if (auto it = info->index.find(func); it != info->index.end()) {
+        info->functions[it->second].func = nullptr;
+        info->index.erase(it);
+    }
+    setValPtr(nullptr);
+}
+
+FunctionSummaryInfo::FunctionSummaryInfo(FunctionSummaryInfo &&other)
+    : functions(std::move(other.functions)), index(std::move(other.index)), handles(std::move(other.handles)) {
+    for (auto &handle : handles) handle.info = this;
+}
+
+void FunctionSummaryInfo::add(Function *func, FunctionSummary summary) {
+    index[func] = functions.size();
+    functions.push_back(std::move(summary));
+    handles.emplace_back(func, this);
+}
+
+const FunctionSummary *FunctionSummaryInfo::lookup(const Function *func) const {
+    auto it = index.find(func);
+    if (it == index.end()) return nullptr;
+    return &functions[it->second];
+}
+
+/* Function passes read the summaries through ModuleAnalysisManagerFunctionProxy, which only accepts
+ * results that stay valid until they are abandoned explicitly, the same way as GlobalsAA.
+ * Transforms of function bodies abandon them, deleted functions are dropped by their handles. */
+bool FunctionSummaryInfo::invalidate(Module &, const PreservedAnalyses &PA, ModuleAnalysisManager::Invalidator &) {
+    return !PA.getChecker<FunctionSummaryAnalysis>().preservedWhenStateless();
+}
+
+FunctionSummaryInfo FunctionSummaryAnalysis::run(Module &module, ModuleAnalysisManager &AM) {
+    auto &CG = AM.getResult<CallGraphAnalysis>(module);
+
+    FunctionSummaryInfo info;
+    for (auto it = scc_begin(&CG); !it.isAtEnd(); ++it) {
+        Array<Function *> members;
+        for (CallGraphNode *node : *it) {
+            Function *func = node->getFunction();
+            if (func && !func->isDeclaration()) members.push_back(func);
+        }
+
+        /* Optimistic start for the effects, they only grow from here. */
+        for (Function *func : members) {
+            FunctionSummary summary;
+            summary.func = func;
+            summary.effects = MemoryEffects::none();
+            summary.no_unwind = true;
+
+            info.add(func, summary);
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (Function *func : members) {
+                FunctionSummary summary;
+                summarize_function(summary, *func, info);
+
+                auto &old = info.functions[info.index[func]];
+                if (summary.effects != old.effects || summary.no_unwind != old.no_unwind || summary.args != old.args) {
+                    changed = true;
+                }
+                old = std::move(summary);
+            }
+        }
+    }
+
+    return info;
+}
+
+namespace {
+
+/* Writes the summaries back as attributes, so that passes which only look at the call site,
+ * like LICM or the may-throw check of LoopFusion, can move the calls around.
+ * Library declarations get their known attributes from TargetLibraryInfo first. */
+struct FunctionSummaryAttrsPass : PassInfoMixin<FunctionSummaryAttrsPass> {
+    static bool isRequired(void) { return true; }
+
+    bool update_arguments(Function &func, const FunctionSummary &summary) {
+        bool changed = false;
+        for (auto [arg, arg_summary] : zip(func.args(), summary.args)) {
+            if (!arg.getType()->isPointerTy()) continue;
+
+            if (!arg_summary.captured && !arg.hasNoCaptureAttr()) {
+                arg.addAttr(Attribute::NoCapture);
+                changed = true;
+            }
+
+            if (arg_summary.unused && !arg.hasAttribute(Attribute::ReadNone)) {
+                arg.removeAttr(Attribute::ReadOnly);
+                arg.removeAttr(Attribute::WriteOnly);
+                arg.addAttr(Attribute::ReadNone);
+                changed = true;
+            } else if (arg_summary.read_only && !arg.onlyReadsMemory() && !arg.hasAttribute(Attribute::WriteOnly)) {
+                arg.addAttr(Attribute::ReadOnly);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    auto run(Module &module, ModuleAnalysisManager &AM) {
+        TimeTraceScope time_scope("SummaryAttrs", module.getModuleIdentifier());
+        out() << "\n[SummaryAttrs]\n";
+
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+
+        bool changed = false;
+        for (auto &func : module) {
+            if (!func.isDeclaration()) continue;
+            changed |= inferNonMandatoryLibFuncAttrs(func, FAM.getResult<TargetLibraryAnalysis>(func));
+        }
+
+        /* Cached summaries survive the passes that ran since, so they are computed again. */
+        PreservedAnalyses stale = PreservedAnalyses::all();
+        stale.abandon<FunctionSummaryAnalysis>();
+        AM.invalidate(module, stale);
+
+        auto &info = AM.getResult<FunctionSummaryAnalysis>(module);
+        for (auto &summary : info.functions) {
+            if (!summary.func || !summary.func->hasExactDefinition()) continue;
+            Function &func = *summary.func;
+
+            bool func_changed = update_arguments(func, summary);
+
+            MemoryEffects effects = func.getMemoryEffects() & summary.effects;
+            if (effects != func.getMemoryEffects()) {
+                func.setMemoryEffects(effects);
+                func_changed = true;
+            }
+            if (summary.no_unwind && !func.doesNotThrow()) {
+                func.setDoesNotThrow();
+                func_changed = true;
+            }
+
+            if (func_changed) {
+                ++functions_changed;
+                if (has_result_sink()) {
+                    emit(Record("SummaryAttrs", func).add_printed("memory", func.getMemoryEffects()));
+                } else {
+                    out() << "Function " << func.getName() << "(): " << func.getMemoryEffects() << "\n";
+                }
+                changed = true;
+            }
+        }
+
+        if (!changed) return PreservedAnalyses::all();
+
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        PA.preserve<FunctionSummaryAnalysis>();
+        return PA;
+    }
+};
+
+}  // namespace
+
+bool register_function_summary_pass(StringRef pass_name, ModulePassManager &MPM, ...) {
+    if (pass_name == "SummaryAttrs") {
+        MPM.addPass(FunctionSummaryAttrsPass());
+        return true;
+    }
+    return false;
+}
+
+void register_function_summary_analysis(ModuleAnalysisManager &MAM) {
+    MAM.registerPass([] { return FunctionSummaryAnalysis(); });
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <list>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/ModRef.h"
+
+#include "Common.hpp"
+
+struct ArgumentSummary {
+    bool unused = false;
+    /* Pointer arguments only: nothing is stored through the pointer, here or in callees. */
+    bool read_only = false;
+    /* Pointer arguments only: the pointer may outlive the call. */
+    bool captured = true;
+
+    bool operator==(const ArgumentSummary &other) const {
+        return unused == other.unused && read_only == other.read_only && captured == other.captured;
+    }
+};
+
+/* What callers need to know about a function without looking into its body.
+ * Accesses to allocas of the function itself are local and not part of the effects. */
+struct FunctionSummary {
+    llvm::Function *func = nullptr;
+    Array<ArgumentSummary> args;
+    llvm::MemoryEffects effects = llvm::MemoryEffects::unknown();
+    bool no_unwind = false;
+
+    u32 call_sites = 0;
+    u32 callees = 0;
+    u32 size = 0;
+};
+
+struct FunctionSummaryInfo {
+    /* Drops the summary of a function that is deleted, like by globaldce or the inliner. */
+    struct DeletionHandle final : llvm::CallbackVH {
+        FunctionSummaryInfo *info;
+
+        DeletionHandle(llvm::Function *func, FunctionSummaryInfo *info) : CallbackVH(func), info(info) {}
+        void deleted() override;
+    };
+
+    /* Defined functions, callees before callers. func is nullptr once the function is deleted. */
+    Array<FunctionSummary> functions;
+    llvm::DenseMap<const llvm::Function *, u32> index;
+    std::list<DeletionHandle> handles;
+
+    FunctionSummaryInfo() = default;
+    /* The handles point back to the result, which is moved into the analysis manager. */
+    FunctionSummaryInfo(FunctionSummaryInfo &&other);
+
+    void add(llvm::Function *func, FunctionSummary summary);
+    const FunctionSummary *lookup(const llvm::Function *func) const;
+
+    bool invalidate(
+        llvm::Module &module, const llvm::PreservedAnalyses &PA, llvm::ModuleAnalysisManager::Invalidator &inv
+    );
+};
+
+/* Summarizes a single function, calls to functions found in known use their summaries,
+ * all other calls fall back to the attributes of the call site. */
+void summarize_function(FunctionSummary &summary, llvm::Function &func, const FunctionSummaryInfo &known);
+
+void print_summary(llvm::raw_ostream &os, const FunctionSummary &summary);
+void emit_summary(llvm::StringRef pass, const FunctionSummary &summary);
+
+/* Bottom-up over the SCCs of the call graph,
+ * recursive functions are iterated until their summaries stop changing.
+ * The result is only invalidated when a pass abandons it, like the transforms of this plugin do
+ * when they change a function. Deleted functions drop out of it. */
+struct FunctionSummaryAnalysis : llvm::AnalysisInfoMixin<FunctionSummaryAnalysis> {
+    using Result = FunctionSummaryInfo;
+
+    Result run(llvm::Module &module, llvm::ModuleAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<FunctionSummaryAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_function_summary_pass(llvm::StringRef pass_name, llvm::ModulePassManager &MPM, ...);
+void register_function_summary_analysis(llvm::ModuleAnalysisManager &MAM);
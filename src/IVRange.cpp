@@ -0,0 +1,307 @@
+#include "IVRange.hpp"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include "AnalysisCache.hpp"
+#include "FunctionSummary.hpp"
+#include "Inductions.hpp"
+#include "Output.hpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "bounds-check-elim"
+
+STATISTIC(checks_removed, "Number of bounds checks removed");
+
+AnalysisKey IVRangeAnalysis::Key;
+
+const SCEV *get_backedge_bound(const Loop *loop, const BasicBlock *ignored, ScalarEvolution &SE) {
+    Array<BasicBlock *> exiting;
+    loop->getExitingBlocks(exiting);
+
+    Array<const SCEV *> counts;
+    for (BasicBlock *bb : exiting) {
+        if (bb == ignored) continue;
+
+        /* Skipping an exit only makes the bound larger, which is still an upper bound. */
+        const SCEV *count = SE.getExitCount(loop, bb);
+        if (isa<SCEVCouldNotCompute>(count)) {
+            count = SE.getExitCount(loop, bb, ScalarEvolution::ConstantMaximum);
+        }
+        if (isa<SCEVCouldNotCompute>(count)) continue;
+
+        counts.push_back(count);
+    }
+
+    if (counts.empty()) return SE.getCouldNotCompute();
+    return SE.getUMinFromMismatchedTypes(counts);
+}
+
+namespace {
+
+/* Whether the recurrence wraps on none of the iterations up to bound. The nsw and nuw flags only
+ * cover the iterations that run, the bound can be larger than the trip count when exits are left out
+ * or only their constant maximum is known. start + step * k is computed on ranges in a type wide
+ * enough to never overflow and has to fit the type of the recurrence. */
+bool no_wrap_until(const SCEVAddRecExpr *evolution, const SCEV *bound, bool is_signed, ScalarEvolution &SE) {
+    if (isa<SCEVCouldNotCompute>(bound) || !evolution->isAffine()) return false;
+
+    u32 bits = SE.getTypeSizeInBits(evolution->getType());
+    u32 wide = bits + SE.getTypeSizeInBits(bound->getType()) + 2;
+
+    ConstantRange start = is_signed
+        ? SE.getSignedRange(evolution->getStart()).signExtend(wide)
+        : SE.getUnsignedRange(evolution->getStart()).zeroExtend(wide);
+    ConstantRange step = SE.getSignedRange(evolution->getStepRecurrence(SE)).signExtend(wide);
+    ConstantRange iterations = ConstantRange::getNonEmpty(
+        APInt::getZero(wide), SE.getUnsignedRangeMax(bound).zext(wide) + 1
+    );
+    ConstantRange values = start.add(step.multiply(iterations));
+
+    ConstantRange valid = is_signed
+        ? ConstantRange::getNonEmpty(APInt::getSignedMinValue(bits).sext(wide), APInt::getSignedMaxValue(bits).sext(wide) + 1)
+        : ConstantRange::getNonEmpty(APInt::getZero(wide), APInt::getMaxValue(bits).zext(wide) + 1);
+    return valid.contains(values);
+}
+
+}  // namespace
+
+void get_evolution_range(
+    ValueRange &range, const SCEVAddRecExpr *evolution, const SCEV *backedge_bound, ScalarEvolution &SE
+) {
+    range.first = evolution->getStart();
+    range.last = isa<SCEVCouldNotCompute>(backedge_bound)
+        ? backedge_bound
+        : evolution->evaluateAtIteration(backedge_bound, SE);
+
+    /* Without wrapping the recurrence is monotonic and lies between its first and last value. */
+    if (no_wrap_until(evolution, backedge_bound, true, SE)) {
+        range.range = SE.getSignedRange(range.first).unionWith(SE.getSignedRange(range.last), ConstantRange::Signed);
+    } else {
+        range.range = SE.getSignedRange(evolution);
+    }
+}
+
+const ValueRange *IVRangeInfo::lookup(const Instruction *instr) const {
+    auto it = index.find(instr);
+    if (it == index.end()) return nullptr;
+    return &ranges[it->second];
+}
+
+bool IVRangeInfo::invalidate(Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = PA.getChecker<IVRangeAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<ScalarEvolutionAnalysis>(func, PA)
+        || inv.invalidate<InductionAnalysis>(func, PA);
+}
+
+IVRangeInfo IVRangeAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+    auto &IA = AM.getResult<InductionAnalysis>(func);
+
+    IVRangeInfo info;
+    for (auto &inductions : IA.loops) {
+        const SCEV *bound = get_backedge_bound(inductions.loop, nullptr, SE);
+
+        for (auto &variable : inductions.variables) {
+            if (!variable.instr->getType()->isIntegerTy()) continue;
+
+            ValueRange range;
+            range.instr = variable.instr;
+            get_evolution_range(range, variable.evolution, bound, SE);
+
+            info.index[variable.instr] = info.ranges.size();
+            info.ranges.push_back(range);
+        }
+    }
+
+    return info;
+}
+
+namespace {
+
+struct IVRangePrintPass : PassInfoMixin<IVRangePrintPass> {
+    static bool isRequired(void) { return true; }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("IVRange", func.getName());
+        out() << "\n[IVRange]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &info = AM.getResult<IVRangeAnalysis>(func);
+        for (auto &range : info.ranges) {
+            if (has_result_sink()) {
+                emit(Record("IVRange", func)
+                    .add("variable", range.instr->getName())
+                    .add_printed("first", *range.first)
+                    .add_printed("last", *range.last)
+                    .add_printed("range", range.range));
+                continue;
+            }
+
+            out() << "  " << *range.instr << "\n";
+            out() << "    From " << *range.first << " to " << *range.last << ", range: " << range.range << "\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+/* Branches of safe languages that guard an access, leading to a block that never returns,
+ * like a call to panic_bounds_check followed by unreachable. */
+bool is_failure_block(BasicBlock *bb) {
+    if (isa<UnreachableInst>(bb->getTerminator())) return true;
+
+    for (auto &instr : *bb) {
+        if (auto *call = dyn_cast<CallBase>(&instr)) {
+            if (call->doesNotReturn()) return true;
+        }
+    }
+    return false;
+}
+
+/* Removes bounds checks inside of loops that hold on every iteration:
+ * the checked value is an affine recurrence, the bound is loop invariant
+ * and the comparison holds for both the first and the last value. */
+struct BoundsCheckElimPass : PassInfoMixin<BoundsCheckElimPass> {
+    static bool isRequired(void) { return true; }
+
+    bool always_holds(CmpInst::Predicate pred, const SCEV *lhs, const SCEV *rhs, BasicBlock *check, ScalarEvolution &SE) {
+        auto *evolution = dyn_cast<SCEVAddRecExpr>(lhs);
+        if (!evolution) {
+            evolution = dyn_cast<SCEVAddRecExpr>(rhs);
+            if (!evolution) return false;
+
+            std::swap(lhs, rhs);
+            pred = CmpInst::getSwappedPredicate(pred);
+        }
+
+        const Loop *loop = evolution->getLoop();
+        if (!evolution->isAffine() || !loop->contains(check) || !SE.isLoopInvariant(rhs, loop)) return false;
+
+        ValueRange range;
+        const SCEV *bound = get_backedge_bound(loop, check, SE);
+        get_evolution_range(range, evolution, bound, SE);
+
+        if (ConstantRange::makeSatisfyingICmpRegion(pred, SE.getSignedRange(rhs)).contains(range.range)) return true;
+        if (ConstantRange::makeSatisfyingICmpRegion(pred, SE.getUnsignedRange(rhs)).contains(SE.getUnsignedRange(evolution))) {
+            return true;
+        }
+
+        /* The bound leaves out the exit of the check, so the flags of the recurrence are not enough. */
+        bool monotonic = (CmpInst::isUnsigned(pred) || CmpInst::isSigned(pred))
+            && no_wrap_until(evolution, bound, CmpInst::isSigned(pred), SE);
+        if (!monotonic || isa<SCEVCouldNotCompute>(range.last)) return false;
+
+        auto holds = [&](CmpInst::Predicate pred, const SCEV *lhs, const SCEV *rhs) {
+            return SE.isKnownPredicate(pred, lhs, rhs) || SE.isLoopEntryGuardedByCond(loop, pred, lhs, rhs);
+        };
+
+        /* The last value is often rhs - d, like for i < len with the latch exiting at i + 1 == len.
+         * It stays below rhs unless the subtraction wraps, so rhs >= d is enough,
+         * and for d == 1 that already follows from the first value being below rhs. */
+        auto last_holds = [&]() {
+            if (holds(pred, range.last, rhs)) return true;
+            if (pred != CmpInst::ICMP_ULT && pred != CmpInst::ICMP_ULE) return false;
+
+            auto *distance = dyn_cast<SCEVConstant>(SE.getMinusSCEV(rhs, range.last));
+            if (!distance || distance->getAPInt().isNegative()) return false;
+            if (pred == CmpInst::ICMP_ULT) {
+                if (distance->getAPInt().isZero()) return false;
+                if (distance->getAPInt().isOne()) return true;
+            }
+            return holds(CmpInst::ICMP_UGE, rhs, distance);
+        };
+
+        return holds(pred, range.first, rhs) && last_holds();
+    }
+
+    bool eliminate(BasicBlock *bb, ScalarEvolution &SE) {
+        auto *br = dyn_cast<BranchInst>(bb->getTerminator());
+        if (!br || !br->isConditional()) return false;
+
+        auto *cmp = dyn_cast<ICmpInst>(br->getCondition());
+        if (!cmp || !SE.isSCEVable(cmp->getOperand(0)->getType())) return false;
+
+        bool fails_on_true = is_failure_block(br->getSuccessor(0));
+        bool fails_on_false = is_failure_block(br->getSuccessor(1));
+        if (fails_on_true == fails_on_false) return false;
+
+        /* The check passes when the condition is the one leading away from the failure. */
+        CmpInst::Predicate pred = fails_on_true ? cmp->getInversePredicate() : cmp->getPredicate();
+        const SCEV *lhs = SE.getSCEV(cmp->getOperand(0));
+        const SCEV *rhs = SE.getSCEV(cmp->getOperand(1));
+        if (!always_holds(pred, lhs, rhs, bb, SE)) return false;
+
+        BasicBlock *failure = br->getSuccessor(fails_on_true ? 0 : 1);
+
+        br->setCondition(ConstantInt::getBool(bb->getContext(), !fails_on_true));
+        ConstantFoldTerminator(bb);
+        RecursivelyDeleteTriviallyDeadInstructions(cmp);
+
+        if (pred_empty(failure)) {
+            DeleteDeadBlock(failure);
+        }
+        return true;
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("BoundsCheckElim", func.getName());
+        auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+        auto &LA = AM.getResult<LoopAnalysis>(func);
+
+        bool changed = false;
+        for (Loop *loop : LA.getLoopsInPreorder()) {
+            bool loop_changed = false;
+            for (BasicBlock *bb : loop->blocks()) {
+                if (LA.getLoopFor(bb) != loop) continue;
+
+                if (eliminate(bb, SE)) {
+                    ++checks_removed;
+                    if (has_result_sink()) {
+                        emit(Record("BoundsCheckElim", func).add("block", bb->getName()).add("loop", loop->getName()));
+                    } else {
+                        out() << "Removed bounds check in block '" << bb->getName() << "' of loop at " << loop->getName() << "\n";
+                    }
+                    loop_changed = true;
+                }
+            }
+
+            if (loop_changed) {
+                SE.forgetLoop(loop);
+                changed = true;
+            }
+        }
+
+        if (!changed) return PreservedAnalyses::all();
+
+        PreservedAnalyses PA;
+        PA.preserve<LoopAnalysis>();
+        PA.abandon<FunctionSummaryAnalysis>();
+        return PA;
+    }
+};
+
+}  // namespace
+
+bool register_iv_range_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "IVRange") {
+        add_cacheable_pass(FPM, "IVRange", IVRangePrintPass());
+        return true;
+    }
+    if (pass_name == "BoundsCheckElim") {
+        FPM.addPass(BoundsCheckElimPass());
+        return true;
+    }
+    return false;
+}
+
+void register_iv_range_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return IVRangeAnalysis(); });
+}
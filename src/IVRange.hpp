@@ -0,0 +1,56 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* Values an affine recurrence takes over the iterations of its loop.
+ * first and last are symbolic, range is the signed constant range. */
+struct ValueRange {
+    llvm::Instruction *instr = nullptr;
+    const llvm::SCEV *first = nullptr;
+    /* SCEVCouldNotCompute if the loop is not bounded. */
+    const llvm::SCEV *last = nullptr;
+    llvm::ConstantRange range = llvm::ConstantRange(1, true);
+};
+
+/* Upper bound of the backedge-taken count as the minimum of the exit counts of all
+ * exiting blocks except ignored, so a check can be evaluated assuming it never fires. */
+const llvm::SCEV *get_backedge_bound(
+    const llvm::Loop *loop, const llvm::BasicBlock *ignored, llvm::ScalarEvolution &SE
+);
+
+void get_evolution_range(
+    ValueRange &range, const llvm::SCEVAddRecExpr *evolution, const llvm::SCEV *backedge_bound,
+    llvm::ScalarEvolution &SE
+);
+
+struct IVRangeInfo {
+    /* Integer induction variables (basic and derived) of every loop. */
+    Array<ValueRange> ranges;
+    llvm::DenseMap<const llvm::Instruction *, u32> index;
+
+    const ValueRange *lookup(const llvm::Instruction *instr) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct IVRangeAnalysis : llvm::AnalysisInfoMixin<IVRangeAnalysis> {
+    using Result = IVRangeInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<IVRangeAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_iv_range_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_iv_range_analysis(llvm::FunctionAnalysisManager &FAM);
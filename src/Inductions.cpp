@@ -0,0 +1,226 @@
+#include "Inductions.hpp"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include "FunctionSummary.hpp"
+#include "Output.hpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "iv-canonicalize"
+
+STATISTIC(loops_canonicalized, "Number of loops with canonicalized induction variables");
+
+AnalysisKey InductionAnalysis::Key;
+
+namespace {
+
+const SCEVAddRecExpr *get_affine_evolution(Value *value, const Loop *loop, ScalarEvolution &SE) {
+    if (!SE.isSCEVable(value->getType())) return nullptr;
+
+    auto *add_rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(value));
+    if (!add_rec || add_rec->getLoop() != loop || !add_rec->isAffine()) return nullptr;
+
+    return add_rec;
+}
+
+/* Values that only advance a header PHI to the next iteration, like i.next = i + 1. */
+bool is_increment(Instruction &instr, const Loop *loop) {
+    for (PHINode &phi : loop->getHeader()->phis()) {
+        for (BasicBlock *pred : predecessors(loop->getHeader())) {
+            if (loop->contains(pred) && phi.getIncomingValueForBlock(pred) == &instr) return true;
+        }
+    }
+    return false;
+}
+
+/* Finds instr = scale * basic + offset for one of the basic variables
+ * whose step evenly divides the step of the derived one. */
+void relate_to_basic(InductionVariable &derived, ArrayRef<InductionVariable> variables, ScalarEvolution &SE) {
+    if (derived.instr->getType()->isPointerTy()) return;
+
+    auto *step = dyn_cast<SCEVConstant>(derived.evolution->getStepRecurrence(SE));
+    if (!step) return;
+
+    for (auto &candidate : variables) {
+        if (candidate.kind != InductionVariable::IV_BASIC) continue;
+        if (candidate.instr->getType() != derived.instr->getType()) continue;
+
+        auto *basic_step = dyn_cast<SCEVConstant>(candidate.evolution->getStepRecurrence(SE));
+        if (!basic_step || basic_step->getAPInt().isZero()) continue;
+        if (!step->getAPInt().srem(basic_step->getAPInt()).isZero()) continue;
+
+        derived.basic = cast<PHINode>(candidate.instr);
+        derived.scale = SE.getConstant(step->getAPInt().sdiv(basic_step->getAPInt()));
+        derived.offset = SE.getMinusSCEV(
+            derived.evolution->getStart(), SE.getMulExpr(derived.scale, candidate.evolution->getStart())
+        );
+        return;
+    }
+}
+
+void collect_inductions(LoopInductions &inductions, Loop *loop, LoopInfo &LI, ScalarEvolution &SE) {
+    inductions.loop = loop;
+
+    for (PHINode &phi : loop->getHeader()->phis()) {
+        auto *evolution = get_affine_evolution(&phi, loop, SE);
+        if (!evolution) continue;
+
+        InductionVariable variable;
+        variable.kind = phi.getType()->isPointerTy() ? InductionVariable::IV_POINTER : InductionVariable::IV_BASIC;
+        variable.instr = &phi;
+        variable.evolution = evolution;
+        inductions.variables.push_back(variable);
+    }
+
+    u32 header_variables = inductions.variables.size();
+
+    for (BasicBlock *bb : loop->blocks()) {
+        /* Values of the sub loops are reported with the sub loops. */
+        if (LI.getLoopFor(bb) != loop) continue;
+
+        for (Instruction &instr : *bb) {
+            if (isa<PHINode>(instr) && bb == loop->getHeader()) continue;
+            if (is_increment(instr, loop)) continue;
+
+            auto *evolution = get_affine_evolution(&instr, loop, SE);
+            if (!evolution) continue;
+
+            InductionVariable variable;
+            variable.kind = InductionVariable::IV_DERIVED;
+            variable.instr = &instr;
+            variable.evolution = evolution;
+            relate_to_basic(variable, ArrayRef<InductionVariable>(inductions.variables).take_front(header_variables), SE);
+            inductions.variables.push_back(variable);
+        }
+    }
+}
+
+}  // namespace
+
+const LoopInductions *InductionInfo::lookup(const Loop *loop) const {
+    auto it = index.find(loop);
+    if (it == index.end()) return nullptr;
+    return &loops[it->second];
+}
+
+bool InductionInfo::invalidate(Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = PA.getChecker<InductionAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<ScalarEvolutionAnalysis>(func, PA)
+        || inv.invalidate<LoopAnalysis>(func, PA);
+}
+
+InductionInfo InductionAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+
+    InductionInfo info;
+    for (Loop *loop : LA.getLoopsInPreorder()) {
+        info.index[loop] = info.loops.size();
+        collect_inductions(info.loops.emplace_back(), loop, LA, SE);
+    }
+
+    return info;
+}
+
+namespace {
+
+/* Rewrites every header induction variable of a loop as an expression of a single
+ * canonical counter {0,+,1}, so only one of them stays live across the back edge.
+ * Derived values computed in the body follow automatically. */
+struct IVCanonicalizePass : PassInfoMixin<IVCanonicalizePass> {
+    static bool isRequired(void) { return true; }
+
+    bool canonicalize(Loop *loop, ScalarEvolution &SE, const DataLayout &DL) {
+        if (!loop->isLoopSimplifyForm()) return false;
+
+        Array<PHINode *> variables;
+        Type *widest = nullptr;
+        for (PHINode &phi : loop->getHeader()->phis()) {
+            if (!get_affine_evolution(&phi, loop, SE)) continue;
+
+            variables.push_back(&phi);
+            if (phi.getType()->isIntegerTy()
+                && (!widest || widest->getIntegerBitWidth() < phi.getType()->getIntegerBitWidth())) {
+                widest = phi.getType();
+            }
+        }
+
+        /* A single variable is as cheap as a canonical one. */
+        if (variables.size() < 2) return false;
+        if (!widest) widest = DL.getIndexType(variables.front()->getType());
+
+        /* In canonical mode the expander reuses or creates the {0,+,1} counter
+         * and expands every other recurrence as start + step * counter. */
+        SCEVExpander expander(SE, DL, "iv.canonical");
+        Instruction *insert_point = &*loop->getHeader()->getFirstInsertionPt();
+
+        const SCEV *canonical = SE.getAddRecExpr(SE.getZero(widest), SE.getOne(widest), loop, SCEV::FlagAnyWrap);
+        Value *counter = expander.expandCodeFor(canonical, widest, insert_point);
+
+        bool changed = false;
+        insert_point = &*loop->getHeader()->getFirstInsertionPt();
+        for (PHINode *phi : variables) {
+            if (phi == counter) continue;
+
+            /* Otherwise the expander finds the PHI itself as an existing value for its evolution. */
+            const SCEV *evolution = SE.getSCEV(phi);
+            SE.forgetValue(phi);
+
+            Value *rewritten = expander.expandCodeFor(evolution, phi->getType(), insert_point);
+            phi->replaceAllUsesWith(rewritten);
+            RecursivelyDeleteDeadPHINode(phi);
+            changed = true;
+        }
+
+        SE.forgetLoop(loop);
+        return changed;
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("IVCanonicalize", func.getName());
+        auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+        auto &LA = AM.getResult<LoopAnalysis>(func);
+
+        bool changed = false;
+        for (Loop *loop : LA.getLoopsInPreorder()) {
+            if (canonicalize(loop, SE, func.getParent()->getDataLayout())) {
+                ++loops_canonicalized;
+                if (has_result_sink()) {
+                    emit(Record("IVCanonicalize", func).add("loop", loop->getName()));
+                } else {
+                    out() << "Canonicalized induction variables of loop at " << loop->getName() << "\n";
+                }
+                changed = true;
+            }
+        }
+
+        if (!changed) return PreservedAnalyses::all();
+
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        PA.abandon<FunctionSummaryAnalysis>();
+        return PA;
+    }
+};
+
+}  // namespace
+
+bool register_induction_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "IVCanonicalize") {
+        FPM.addPass(IVCanonicalizePass());
+        return true;
+    }
+    return false;
+}
+
+void register_induction_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return InductionAnalysis(); });
+}
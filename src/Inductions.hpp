@@ -0,0 +1,60 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+struct InductionVariable {
+    typedef enum {
+        /* Integer header PHI. */
+        IV_BASIC,
+        /* Pointer header PHI. */
+        IV_POINTER,
+        /* Value computed in the body that is affine in the loop, like j = 4*i + c or &a[i]. */
+        IV_DERIVED,
+    } Kind;
+
+    Kind kind = IV_BASIC;
+    llvm::Instruction *instr = nullptr;
+    const llvm::SCEVAddRecExpr *evolution = nullptr;
+
+    /* Derived variables only: instr = scale * basic + offset,
+     * basic is nullptr when no basic variable of the loop fits. */
+    llvm::PHINode *basic = nullptr;
+    const llvm::SCEV *scale = nullptr;
+    const llvm::SCEV *offset = nullptr;
+};
+
+struct LoopInductions {
+    llvm::Loop *loop = nullptr;
+    Array<InductionVariable> variables;
+};
+
+struct InductionInfo {
+    /* Every loop of the function in preorder. */
+    Array<LoopInductions> loops;
+    llvm::DenseMap<const llvm::Loop *, u32> index;
+
+    const LoopInductions *lookup(const llvm::Loop *loop) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct InductionAnalysis : llvm::AnalysisInfoMixin<InductionAnalysis> {
+    using Result = InductionInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<InductionAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_induction_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_induction_analysis(llvm::FunctionAnalysisManager &FAM);
@@ -0,0 +1,126 @@
+#include "LoopCost.hpp"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.hpp"
+#include "MemoryUsage.hpp"
+#include "Output.hpp"
+#include "StaticFrequency.hpp"
+
+using namespace llvm;
+
+s64 get_instruction_cost(
+    const Instruction &instr, const TargetTransformInfo &TTI, TargetTransformInfo::TargetCostKind kind
+) {
+    InstructionCost cost = TTI.getInstructionCost(&instr, kind);
+    if (!cost.isValid()) return 0;
+    return *cost.getValue();
+}
+
+s64 get_block_cost(const BasicBlock &bb, const TargetTransformInfo &TTI, TargetTransformInfo::TargetCostKind kind) {
+    s64 cost = 0;
+    for (auto &instr : bb) {
+        cost += get_instruction_cost(instr, TTI, kind);
+    }
+    return cost;
+}
+
+namespace {
+
+struct BlockCost {
+    s64 throughput;
+    s64 latency;
+};
+
+/* Estimated cycles of every loop and of the whole function:
+ * the TTI cost of each block times its static frequency, which already
+ * multiplies the branch probabilities by the trip counts of the enclosing loops. */
+struct LoopCostPass : PassInfoMixin<LoopCostPass> {
+    DenseMap<const BasicBlock *, BlockCost> costs;
+
+    static bool isRequired(void) { return true; }
+
+    void print_loop(Function &func, Loop *loop, const StaticFrequencyInfo &SF) {
+        f64 header_frequency = SF.frequency(loop->getHeader());
+
+        f64 per_iteration_throughput = 0;
+        f64 per_iteration_latency = 0;
+        f64 cycles = 0;
+        for (BasicBlock *bb : loop->blocks()) {
+            f64 frequency = SF.frequency(bb);
+            auto cost = costs.lookup(bb);
+
+            cycles += frequency * cost.throughput;
+            if (header_frequency > 0) {
+                per_iteration_throughput += frequency / header_frequency * cost.throughput;
+                per_iteration_latency += frequency / header_frequency * cost.latency;
+            }
+        }
+
+        if (has_result_sink()) {
+            emit(Record("LoopCost", func)
+                .add("loop", loop->getName())
+                .add("depth", loop->getLoopDepth())
+                .add("throughput", per_iteration_throughput)
+                .add("latency", per_iteration_latency)
+                .add("trip_count", SF.trips.lookup(loop))
+                .add("cycles_per_call", cycles));
+        } else {
+            out().indent(loop->getLoopDepth() * 2) << "Loop at " << loop->getName() << ": "
+                << format("%.2f", per_iteration_throughput) << " throughput, "
+                << format("%.2f", per_iteration_latency) << " latency per iteration, "
+                << "trip count " << format("%.2f", SF.trips.lookup(loop)) << ", "
+                << "~" << format("%.2f", cycles) << " cycles per call\n";
+        }
+
+        for (Loop *sub_loop : loop->getSubLoops()) {
+            print_loop(func, sub_loop, SF);
+        }
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("LoopCost", func.getName());
+        out() << "\n[LoopCost]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &TTI = AM.getResult<TargetIRAnalysis>(func);
+        auto &LA = AM.getResult<LoopAnalysis>(func);
+        auto &SF = AM.getResult<StaticFrequencyAnalysis>(func);
+
+        costs.clear();
+        f64 function_cycles = 0;
+        for (auto &bb : func) {
+            BlockCost cost = {
+                get_block_cost(bb, TTI, TargetTransformInfo::TCK_RecipThroughput),
+                get_block_cost(bb, TTI, TargetTransformInfo::TCK_Latency),
+            };
+            costs[&bb] = cost;
+            function_cycles += SF.frequency(&bb) * cost.throughput;
+        }
+
+        for (Loop *loop : LA) {
+            print_loop(func, loop, SF);
+        }
+        if (has_result_sink()) {
+            emit(Record("LoopCost", func).add("cycles_per_call", function_cycles));
+        } else {
+            out() << "  Total: ~" << format("%.2f", function_cycles) << " cycles per call\n";
+        }
+        report_owned_memory("costs", costs.getMemorySize());
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_loop_cost_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "LoopCost") {
+        add_cacheable_pass(FPM, "LoopCost", LoopCostPass(), static_frequency_options());
+        return true;
+    }
+    return false;
+}
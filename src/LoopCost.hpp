@@ -0,0 +1,19 @@
+#pragma once
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* TTI cost of a single instruction, invalid costs count as 0. */
+s64 get_instruction_cost(
+    const llvm::Instruction &instr, const llvm::TargetTransformInfo &TTI,
+    llvm::TargetTransformInfo::TargetCostKind kind
+);
+
+s64 get_block_cost(
+    const llvm::BasicBlock &bb, const llvm::TargetTransformInfo &TTI,
+    llvm::TargetTransformInfo::TargetCostKind kind
+);
+
+bool register_loop_cost_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
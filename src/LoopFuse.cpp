@@ -1,35 +1,46 @@
 #include "LoopFuse.hpp"
 
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/DebugCounter.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/CodeMoverUtils.h"
 
-/* Signed numbers */
-typedef int8_t s8;
-typedef int16_t s16;
-typedef int32_t s32;
-typedef int64_t s64;
-
-/* Unsigned numbers */
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef uint64_t u64;
-
-/* Floating point numbers */
-typedef float f32;
-typedef double f64;
-typedef long double f80;
+#include "AffineAccess.hpp"
+#include "Common.hpp"
+#include "FunctionSummary.hpp"
+#include "MemoryUsage.hpp"
+#include "Output.hpp"
+#include "RegisterPressure.hpp"
 
 using namespace llvm;
 
-template <typename T>
-using Array = SmallVector<T>;
+#define DEBUG_TYPE "loop-fusion"
+
+STATISTIC(loops_analyzed, "Number of loops considered for fusion");
+STATISTIC(candidates_created, "Number of loops that are fusion candidates");
+STATISTIC(rejected_may_throw, "Number of loops rejected as they may throw");
+STATISTIC(rejected_volatile, "Number of loops rejected for volatile memory accesses");
+STATISTIC(rejected_start_mismatch, "Number of loop pairs rejected for different starts");
+STATISTIC(rejected_stop_mismatch, "Number of loop pairs rejected for different stops");
+STATISTIC(rejected_advance_mismatch, "Number of loop pairs rejected for different advances");
+STATISTIC(rejected_non_adjacent, "Number of loop pairs rejected as they are not adjacent");
+STATISTIC(rejected_register_pressure, "Number of loop pairs rejected as the fused body would spill");
+STATISTIC(rejected_dependence, "Number of loop pairs rejected for a dependence between them");
+STATISTIC(fusions_performed, "Number of loops fused");
+STATISTIC(blocks_erased, "Number of blocks erased after fusion");
+STATISTIC(dominator_recalculations, "Number of dominator and post-dominator tree recalculations");
+
+/* -debug-counter=loop-fusion-skip=N,loop-fusion-count=M performs only the fusions N to N+M-1,
+ * to bisect a regression down to a single fusion. */
+DEBUG_COUNTER(fusion_counter, "loop-fusion", "Controls which legal loop fusions are performed");
 
 namespace {
 
@@ -61,6 +72,10 @@ struct FusionCandidate {
 
     Array<Value *> writes;
     Array<Value *> reads;
+
+    Array<Instruction *> memops;
+
+    LoopPressure pressure;
 };
 
 
@@ -114,7 +129,7 @@ void get_loop_memops(FusionCandidate &candidate) {
 }
 
 
-bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> variables) {
+bool get_loop_induction(FusionCandidate &candidate, const DenseMap<Value *, Value *> &variables) {
     Value *induction_variable = nullptr;
 
     Constant *stop_const = nullptr;
@@ -128,7 +143,7 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
                 stop_const = C;
             } else {
                 // dbgs() << "maybe var no const" << *instr.getOperand(1) << "\n";
-                stop_variable = variables[instr.getOperand(1)];
+                stop_variable = variables.lookup(instr.getOperand(1));
             }
         } else if (!induction_variable && isa<LoadInst>(&instr)) {
             induction_variable = instr.getOperand(0);
@@ -136,11 +151,11 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
     }
 
     if (!induction_variable) {
-        dbgs() << "Loop does not have an induction variable.\n";
+        out() << "Loop does not have an induction variable.\n";
         return false;
     }
     if (!stop_const && !stop_variable) {
-        dbgs() << "Loop stop is not a constant or a variable.\n";
+        out() << "Loop stop is not a constant or a variable.\n";
         return false;
     }
 
@@ -158,7 +173,7 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
     }
 
     if (!induction_variable_is_stored) {
-        dbgs() << "Loop induction variable is not used.\n";
+        out() << "Loop induction variable is not used.\n";
         return false;
     }
 
@@ -173,12 +188,12 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
             // Last store value will always be the loop counter start value.
             start_const = C;
         } else {
-            start_variable = variables[instr.getOperand(0)];
+            start_variable = variables.lookup(instr.getOperand(0));
         }
     }
 
     if (!start_const && !start_variable) {
-        dbgs() << "Loop start is not a constant or a variable.\n";
+        out() << "Loop start is not a constant or a variable.\n";
         return false;
     }
 
@@ -194,12 +209,12 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
         if (ConstantInt *C = dyn_cast<ConstantInt>(instr.getOperand(1))) {
             advance_const = C;
         } else {
-            advance_variable = variables[instr.getOperand(1)];
+            advance_variable = variables.lookup(instr.getOperand(1));
         }
     }
 
     if (!advance_const && !advance_variable) {
-        dbgs() << "Loop advance is not a constant or a variable.\n";
+        out() << "Loop advance is not a constant or a variable.\n";
         return false;
     }
 
@@ -217,22 +232,29 @@ bool get_loop_induction(FusionCandidate &candidate, DenseMap<Value *, Value *> v
 }
 
 
-bool create_fusion_candidate(FusionCandidate &candidate, Loop *loop, DenseMap<Value *, Value *> variables) {
+bool create_fusion_candidate(FusionCandidate &candidate, Loop *loop, const DenseMap<Value *, Value *> &variables) {
+    TimeTraceScope time_scope("create_fusion_candidate", loop->getName());
     for (auto &BB : loop->getBlocks()) {
         for (auto &Inst : *BB) {
             if (Inst.mayThrow()) {
-                dbgs() << "Loop contains instruction that may throw exception.\n";
+                ++rejected_may_throw;
+                out() << "Loop contains instruction that may throw exception.\n";
                 return false;
             }
+            if (isa<LoadInst>(&Inst) || isa<StoreInst>(&Inst)) {
+                candidate.memops.push_back(&Inst);
+            }
             if (StoreInst *Store = dyn_cast<StoreInst>(&Inst)) {
                 if (Store->isVolatile()) {
-                    dbgs() << "Loop contains volatile memory access.\n";
+                    ++rejected_volatile;
+                    out() << "Loop contains volatile memory access.\n";
                     return false;
                 }
             }
             if (LoadInst *Load = dyn_cast<LoadInst>(&Inst)) {
                 if (Load->isVolatile()) {
-                    dbgs() << "Loop contains volatile memory access.\n";
+                    ++rejected_volatile;
+                    out() << "Loop contains volatile memory access.\n";
                     return false;
                 }
             }
@@ -241,7 +263,7 @@ bool create_fusion_candidate(FusionCandidate &candidate, Loop *loop, DenseMap<Va
 
     /*
     if (!loop->isLoopSimplifyForm()) {
-        dbgs() << "Loop is not in simplified form.\n";
+        out() << "Loop is not in simplified form.\n";
         return false;
     }
     */
@@ -249,12 +271,12 @@ bool create_fusion_candidate(FusionCandidate &candidate, Loop *loop, DenseMap<Va
     candidate.preheader = loop->getLoopPreheader();
     candidate.exit = loop->getUniqueExitBlock();
     if (!candidate.preheader || !candidate.exit) {
-        dbgs() << "Loop does not have single entry or exit point.\n";
+        out() << "Loop does not have single entry or exit point.\n";
         return false;
     }
 
     if (loop->isAnnotatedParallel()) {
-        dbgs() << "Loop is annotated parallel.\n";
+        out() << "Loop is annotated parallel.\n";
         return false;
     }
 
@@ -262,7 +284,7 @@ bool create_fusion_candidate(FusionCandidate &candidate, Loop *loop, DenseMap<Va
     candidate.latch = loop->getLoopLatch();
     candidate.pre_exit = loop->getExitingBlock();
     if (!candidate.header || !candidate.latch || !candidate.pre_exit) {
-        dbgs() << "Necessary loop information is not available(preheader, header, latch, pre exit, exit block).\n";
+        out() << "Necessary loop information is not available(preheader, header, latch, pre exit, exit block).\n";
         return false;
     }
 
@@ -317,54 +339,64 @@ bool same_loop_evolution(FusionCandidate &c1, FusionCandidate &c2) {
 
     if (i1.stop_const && i2.stop_const) {
         if (!are_constants_equal(i1.stop_const, i2.stop_const)) {
-            dbgs() << "Loop stops are not equal\n";
+            ++rejected_stop_mismatch;
+            out() << "Loop stops are not equal\n";
             return false;
         }
     } else if (i1.stop_variable && i2.stop_variable) {
         if (i1.stop_variable != i2.stop_variable) {
-            dbgs() << "Loop stops are not equal\n";
+            ++rejected_stop_mismatch;
+            out() << "Loop stops are not equal\n";
             return false;
         }
     } else {
-        dbgs() << "Loop stops are not the same kinds of values\n";
+        ++rejected_stop_mismatch;
+        out() << "Loop stops are not the same kinds of values\n";
         return false;
     }
 
 
     if (i1.advance_const && i2.advance_const) {
         if (!are_constants_equal(i1.advance_const, i2.advance_const)) {
-            dbgs() << "Loop advances are not equal\n";
+            ++rejected_advance_mismatch;
+            out() << "Loop advances are not equal\n";
             return false;
         }
     } else if (i1.advance_variable && i2.advance_variable) {
         if (i1.advance_variable != i2.advance_variable) {
-            dbgs() << "Loop advances are not equal\n";
+            ++rejected_advance_mismatch;
+            out() << "Loop advances are not equal\n";
             return false;
         }
     } else {
-        dbgs() << "Loop advances are not the same kinds of values\n";
+        ++rejected_advance_mismatch;
+        out() << "Loop advances are not the same kinds of values\n";
         return false;
     }
 
 
     if (i1.advance_op != i2.advance_op) {
-        dbgs() << "Loop advance operations are not the same\n";
+        ++rejected_advance_mismatch;
+        out() << "Loop advance operations are not the same\n";
         return false;
     }
 
 
     if (i1.start_const && i2.start_const) {
         if (!are_constants_equal(i1.start_const, i2.start_const)) {
-            dbgs() << "Loop advances are not equal\n";
+            ++rejected_start_mismatch;
+            out() << "Loop starts are not equal\n";
             return false;
         }
     } else if (i1.start_variable && i2.start_variable) {
         if (i1.start_variable != i2.start_variable) {
-            dbgs() << "Loop advances are not equal\n";
+            ++rejected_start_mismatch;
+            out() << "Loop starts are not equal\n";
             return false;
         }
     } else {
-        dbgs() << "Loop starts are not the same kinds of values\n";
+        ++rejected_start_mismatch;
+        out() << "Loop starts are not the same kinds of values\n";
         return false;
     }
 
@@ -399,25 +431,104 @@ bool dependent(FusionCandidate &c1, FusionCandidate &c2) {
 }
 
 
-bool can_be_fused(FusionCandidate &c1, FusionCandidate &c2) {
-    return same_loop_evolution(c1, c2) && !dependent(c1, c2) && adjacent(c1, c2);
+/* Checks the accesses of both loops against the affine dependence model.
+ * Fusion runs iteration i of the second loop right after iteration i of the first one,
+ * so a dependence is only preserved if its distance at the fused level is not negative.
+ * Sets decided to false if some access is not affine, the pointer comparison is used then.
+ * A pair the model can not decide, such as accesses to bases that may alias, counts as dependent. */
+bool affine_dependent(FusionCandidate &c1, FusionCandidate &c2, ScalarEvolution &SE, LoopInfo &LI, bool &decided) {
+    decided = false;
+
+    Array<AffineAccess> accesses1(c1.memops.size());
+    Array<AffineAccess> accesses2(c2.memops.size());
+    for (auto [access, instr] : zip(accesses1, c1.memops)) {
+        if (!get_affine_access(access, *instr, SE, LI)) return false;
+    }
+    for (auto [access, instr] : zip(accesses2, c2.memops)) {
+        if (!get_affine_access(access, *instr, SE, LI)) return false;
+    }
+
+    u32 levels = c1.loop->getLoopDepth();
+    for (auto &src : accesses1) {
+        for (auto &dst : accesses2) {
+            AccessDependence dep = compute_dependence(src, dst, levels, SE);
+            if (dep.kind == AccessDependence::DEP_NONE) continue;
+            if (dep.kind == AccessDependence::DEP_UNKNOWN) {
+                out() << "Loops may have a dependence: ";
+                print_dependence(out(), dep);
+                out() << "\n";
+                decided = true;
+                return true;
+            }
+
+            /* Carried by an enclosing loop, fusion does not reorder those iterations. */
+            bool carried_outside = false;
+            for (u32 level = 0; level + 1 < levels; ++level) {
+                if (dep.distance[level] && *dep.distance[level] != 0) carried_outside = true;
+            }
+            if (carried_outside) continue;
+
+            auto distance = dep.distance[levels - 1];
+            if (!distance || *distance < 0) {
+                out() << "Loops have a dependence that fusion would reverse: ";
+                print_dependence(out(), dep);
+                out() << "\n";
+                decided = true;
+                return true;
+            }
+        }
+    }
+
+    decided = true;
+    return false;
+}
+
+
+bool can_be_fused(
+    FusionCandidate &c1, FusionCandidate &c2, ScalarEvolution &SE, LoopInfo &LI, const TargetTransformInfo &TTI
+) {
+    if (!same_loop_evolution(c1, c2)) return false;
+    if (!adjacent(c1, c2)) {
+        ++rejected_non_adjacent;
+        return false;
+    }
+
+    LoopPressure fused = c1.pressure;
+    combine_pressure(fused, c2.pressure, TTI);
+    if (exceeds_registers(fused.max_live, TTI)) {
+        ++rejected_register_pressure;
+        out() << "Fused loop body would spill registers.\n";
+        return false;
+    }
+
+    bool decided;
+    bool is_dependent = affine_dependent(c1, c2, SE, LI, decided);
+    if (!decided) {
+        is_dependent = dependent(c1, c2);
+    }
+    if (is_dependent) ++rejected_dependence;
+    return !is_dependent;
 }
 
 
 struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
+    /* Load of the current function to the address it loads from, cleared for every function. */
     DenseMap<Value *, Value *> variables;
 
     Function *func;
+    bool changed;
 
     LoopAnalysis::Result *LA;
     DominatorTreeAnalysis::Result *DT;
     DependenceAnalysis::Result *DA;
     ScalarEvolutionAnalysis::Result *SE;
     PostDominatorTreeAnalysis::Result *PDT;
+    TargetIRAnalysis::Result *TTI;
 
     static bool isRequired(void) { return true; }
 
     void map_variables() {
+        TimeTraceScope time_scope("map_variables", func->getName());
         for (auto &BB : *func) {
             for (auto &instr : BB) {
                 if (isa<LoadInst>(&instr)) {
@@ -428,21 +539,29 @@ struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
     }
 
     auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("LoopFusion", func.getName());
         this->func = &func;
+        changed = false;
+        variables.clear();
         LA  = &AM.getResult<LoopAnalysis>(func);
         DT  = &AM.getResult<DominatorTreeAnalysis>(func);
         DA  = &AM.getResult<DependenceAnalysis>(func);
         SE  = &AM.getResult<ScalarEvolutionAnalysis>(func);
         PDT = &AM.getResult<PostDominatorTreeAnalysis>(func);
+        TTI = &AM.getResult<TargetIRAnalysis>(func);
 
         map_variables();
         fuse_same_depth_loops_recursive(*LA);
+        report_owned_memory("variables", variables.getMemorySize());
+
+        if (!changed) return PreservedAnalyses::all();
 
         PreservedAnalyses PA;
         PA.preserve<DominatorTreeAnalysis>();
         PA.preserve<DependenceAnalysis>();
         PA.preserve<ScalarEvolutionAnalysis>();
         PA.preserve<PostDominatorTreeAnalysis>();
+        PA.abandon<FunctionSummaryAnalysis>();
         return PA;
     }
 
@@ -455,11 +574,17 @@ struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
             // Nothing is flawless
             fuse_same_depth_loops_recursive(loop->getSubLoops());
 
+            ++loops_analyzed;
             FusionCandidate current;
             if (create_fusion_candidate(current, loop, variables)) {
-                dbgs() << "Have a candidate\n";
-                if (collector_has_data && can_be_fused(collector, current)) {
+                ++candidates_created;
+                out() << "Have a candidate\n";
+                compute_loop_pressure(current.pressure, loop, *LA, *TTI);
+                if (collector_has_data && can_be_fused(collector, current, *SE, *LA, *TTI)
+                    && DebugCounter::shouldExecute(fusion_counter)) {
                     fuse_with_first(collector, current);
+                    collector.memops.append(current.memops);
+                    combine_pressure(collector.pressure, current.pressure, *TTI);
                 } else {
                     collector = current;
                 }
@@ -468,7 +593,14 @@ struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
         }
     }
 
+    void recalculate_dominators(void) {
+        DT->recalculate(*func);
+        PDT->recalculate(*func);
+        ++dominator_recalculations;
+    }
+
     void fuse_with_first(FusionCandidate &c1, FusionCandidate &c2) {
+        TimeTraceScope time_scope("fuse_with_first", c1.loop->getName());
         moveInstructionsToTheEnd(*c2.preheader, *c1.preheader, *DT, *PDT, *DA);
 
         c1.pre_exit->getTerminator()->replaceUsesOfWith(c2.preheader, c2.exit);
@@ -478,21 +610,18 @@ struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
         c1.latch->getTerminator()->replaceUsesOfWith(c1.header, c2.header);
         c2.latch->getTerminator()->replaceUsesOfWith(c2.header, c1.header);
 
-        DT->recalculate(*func);
-        PDT->recalculate(*func);
+        recalculate_dominators();
 
         LA->removeBlock(c2.preheader);
 
-        DT->recalculate(*func);
-        PDT->recalculate(*func);
+        recalculate_dominators();
 
         moveInstructionsToTheBeginning(*c1.latch, *c2.latch, *DT, *PDT, *DA);
         MergeBlockIntoPredecessor(
             c1.latch->getUniqueSuccessor(), nullptr, LA, nullptr, nullptr, false, DT
         );
 
-        DT->recalculate(*func);
-        PDT->recalculate(*func);
+        recalculate_dominators();
 
         Array<BasicBlock *> Blocks(c2.loop->blocks());
         for (BasicBlock *BB : Blocks) {
@@ -505,10 +634,18 @@ struct LoopFusionPass : PassInfoMixin<LoopFusionPass> {
             LA->changeLoopFor(BB, c1.loop);
         }
 
+        u32 blocks_before = func->size();
         EliminateUnreachableBlocks(*func);
+        blocks_erased += blocks_before - func->size();
         LA->erase(c2.loop);
 
-        dbgs() << "Fused\n";
+        ++fusions_performed;
+        changed = true;
+        if (has_result_sink()) {
+            emit(Record("LoopFusion", *func).add("first", c1.loop->getName()).add("second", c2.loop->getName()));
+        } else {
+            out() << "Fused\n";
+        }
     }
 };
 
@@ -0,0 +1,228 @@
+#include "LoopProfile.hpp"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "Output.hpp"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "loop-profile"
+
+STATISTIC(loops_instrumented, "Number of loops with entry and iteration counters");
+STATISTIC(nests_timed, "Number of loop nests with a cycle counter around them");
+
+/* Counters of a loop in the table of a thread, in the order of LoopCounters in runtime/LoopProfile.cpp. */
+typedef enum {
+    COUNTER_ENTRIES,
+    COUNTER_ITERATIONS,
+    COUNTER_CYCLES,
+    COUNTER_COUNT,
+} LoopCounter;
+
+static const char *const REGISTER_FUNCTION = "loop_profile.register";
+
+namespace {
+
+/* Adds to the module a descriptor of its loops, that the runtime knows as LoopProfileModule:
+ *   { u32 loop_count, u32 id (set by the runtime), LoopProfileLoop *loops }
+ *   LoopProfileLoop: { const char *function, const char *header, u32 depth, u32 line }
+ * and a constructor that registers it. Each nest asks the runtime once per entry for the counters
+ * of the current thread, the loops inside only do plain increments on them. */
+struct LoopProfilePass : PassInfoMixin<LoopProfilePass> {
+    Module *module;
+    Type *i32;
+    Type *i64;
+    StructType *loop_type;
+    StructType *module_type;
+    GlobalVariable *descriptor;
+    FunctionCallee counters_function;
+    Function *read_cycle_counter;
+
+    Array<Constant *> loops;
+    Constant *function_name;
+
+    static bool isRequired(void) { return true; }
+
+    auto run(Module &module, ModuleAnalysisManager &AM) {
+        TimeTraceScope time_scope("LoopProfile", module.getModuleIdentifier());
+        out() << "\n[LoopProfile]\n";
+
+        if (module.getFunction(REGISTER_FUNCTION)) {
+            out() << "Module is already instrumented\n";
+            return PreservedAnalyses::all();
+        }
+
+        this->module = &module;
+        loops.clear();
+        /* Created with the first instrumented loop, a module without one is left as it is. */
+        descriptor = nullptr;
+
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+        u32 nests = 0;
+        for (auto &func : module) {
+            if (func.isDeclaration()) continue;
+
+            auto &LI = FAM.getResult<LoopAnalysis>(func);
+            if (LI.empty()) continue;
+
+            function_name = nullptr;
+            for (Loop *loop : LI) {
+                if (instrument_nest(*loop, func)) ++nests;
+            }
+        }
+
+        if (loops.empty()) {
+            out() << "No loops\n";
+            return PreservedAnalyses::all();
+        }
+
+        finish_descriptor();
+        if (has_result_sink()) {
+            emit(Record("LoopProfile", module.getModuleIdentifier()).add("loops", (u64)loops.size()).add("nests", nests));
+        } else {
+            out() << "Instrumented " << loops.size() << " loops in " << nests << " nests\n";
+        }
+        return PreservedAnalyses::none();
+    }
+
+    void create_declarations(void) {
+        LLVMContext &context = module->getContext();
+        i32 = Type::getInt32Ty(context);
+        i64 = Type::getInt64Ty(context);
+        Type *string_type = PointerType::getUnqual(context);
+
+        loop_type = StructType::create(context, {string_type, string_type, i32, i32}, "loop_profile.loop");
+        module_type = StructType::create(
+            context, {i32, i32, PointerType::getUnqual(loop_type)}, "loop_profile.module"
+        );
+        descriptor = new GlobalVariable(
+            *module, module_type, false, GlobalValue::InternalLinkage, nullptr, "loop_profile.module"
+        );
+
+        counters_function = module->getOrInsertFunction(
+            "__loop_profile_counters", PointerType::getUnqual(i64), PointerType::getUnqual(module_type)
+        );
+        read_cycle_counter = Intrinsic::getDeclaration(module, Intrinsic::readcyclecounter);
+    }
+
+    Constant *string(StringRef text) {
+        IRBuilder<> builder(module->getContext());
+        return builder.CreateGlobalStringPtr(text, "loop_profile.name", 0, module);
+    }
+
+    u32 add_loop(Loop &loop) {
+        u32 line = 0;
+        if (DebugLoc location = loop.getStartLoc()) line = location.getLine();
+        if (!function_name) function_name = string(loop.getHeader()->getParent()->getName());
+
+        loops.push_back(ConstantStruct::get(loop_type, {
+            function_name,
+            string(loop.getHeader()->getName()),
+            ConstantInt::get(i32, loop.getLoopDepth()),
+            ConstantInt::get(i32, line),
+        }));
+        ++loops_instrumented;
+        return loops.size() - 1;
+    }
+
+    void add_to_counter(Instruction *before, Value *counters, u32 id, LoopCounter counter, Value *amount) {
+        IRBuilder<> builder(before);
+        Value *slot = builder.CreateConstInBoundsGEP1_64(i64, counters, (u64)id * COUNTER_COUNT + counter);
+        Value *value = builder.CreateLoad(i64, slot);
+        builder.CreateStore(builder.CreateAdd(value, amount), slot);
+    }
+
+    /* Entries are counted in the preheaders and iterations in the headers, so a loop whose exit test
+     * is in the header reports one iteration more per entry than its body runs.
+     * The cycles are taken in the preheader of the nest and in its exit blocks,
+     * leaving the nest by a return or an exception is not timed. */
+    bool instrument_nest(Loop &nest, Function &func) {
+        BasicBlock *preheader = nest.getLoopPreheader();
+        if (!preheader) {
+            out() << "Loop nest " << nest.getName() << " in " << func.getName() << " has no preheader\n";
+            return false;
+        }
+        if (!descriptor) create_declarations();
+
+        IRBuilder<> builder(preheader->getTerminator());
+        Value *counters = builder.CreateCall(counters_function, {descriptor}, "loop_profile.counters");
+        Value *one = ConstantInt::get(i64, 1);
+
+        u32 nest_id = loops.size();
+        for (Loop *loop : nest.getLoopsInPreorder()) {
+            u32 id = add_loop(*loop);
+            if (BasicBlock *inner_preheader = loop->getLoopPreheader()) {
+                add_to_counter(inner_preheader->getTerminator(), counters, id, COUNTER_ENTRIES, one);
+            }
+            add_to_counter(&*loop->getHeader()->getFirstInsertionPt(), counters, id, COUNTER_ITERATIONS, one);
+        }
+
+        if (!nest.hasDedicatedExits()) {
+            out() << "Loop nest " << nest.getName() << " in " << func.getName() << " has shared exits, not timed\n";
+            return true;
+        }
+
+        builder.SetInsertPoint(preheader->getTerminator());
+        Value *start = builder.CreateCall(read_cycle_counter, {}, "loop_profile.start");
+
+        SmallVector<BasicBlock *> exits;
+        nest.getUniqueExitBlocks(exits);
+        for (BasicBlock *exit : exits) {
+            auto position = exit->getFirstInsertionPt();
+            if (position == exit->end()) continue;
+
+            builder.SetInsertPoint(&*position);
+            Value *elapsed = builder.CreateSub(builder.CreateCall(read_cycle_counter), start);
+            add_to_counter(&*position, counters, nest_id, COUNTER_CYCLES, elapsed);
+        }
+        ++nests_timed;
+        return true;
+    }
+
+    void finish_descriptor(void) {
+        auto *array_type = ArrayType::get(loop_type, loops.size());
+        auto *array = new GlobalVariable(
+            *module, array_type, true, GlobalValue::PrivateLinkage, ConstantArray::get(array_type, loops),
+            "loop_profile.loops"
+        );
+        Constant *zero = ConstantInt::get(i32, 0);
+        descriptor->setInitializer(ConstantStruct::get(module_type, {
+            ConstantInt::get(i32, loops.size()),
+            zero,
+            ConstantExpr::getInBoundsGetElementPtr(array_type, array, ArrayRef<Constant *>{zero, zero}),
+        }));
+
+        LLVMContext &context = module->getContext();
+        Function *ctor = Function::Create(
+            FunctionType::get(Type::getVoidTy(context), false), GlobalValue::InternalLinkage, REGISTER_FUNCTION, module
+        );
+        IRBuilder<> builder(BasicBlock::Create(context, "entry", ctor));
+        FunctionCallee register_function = module->getOrInsertFunction(
+            "__loop_profile_register", Type::getVoidTy(context), PointerType::getUnqual(module_type)
+        );
+        builder.CreateCall(register_function, {descriptor});
+        builder.CreateRetVoid();
+
+        /* Before the constructors of the program, which may run loops themselves. */
+        appendToGlobalCtors(*module, ctor, 0);
+    }
+};
+
+}  // namespace
+
+bool register_loop_profile_pass(StringRef pass_name, ModulePassManager &MPM, ...) {
+    if (pass_name == "LoopProfile") {
+        MPM.addPass(createModuleToFunctionPassAdaptor(LoopSimplifyPass()));
+        MPM.addPass(LoopProfilePass());
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* LoopProfile instruments every loop to count its entries and header executions and every loop nest
+ * to measure its cycles, into per-thread tables of runtime/LoopProfile.cpp that are written out at exit.
+ * Loops are put in simplified form first, so that they have preheaders and dedicated exits. */
+bool register_loop_profile_pass(llvm::StringRef pass_name, llvm::ModulePassManager &MPM, ...);
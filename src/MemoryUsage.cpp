@@ -0,0 +1,132 @@
+#include "MemoryUsage.hpp"
+
+#include <cstdlib>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "llvm/ADT/Any.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Output.hpp"
+
+using namespace llvm;
+
+static cl::opt<bool> memory_usage(
+    "memory-usage",
+    cl::desc("Print the growth of heap and peak RSS of every pass and analysis, per function"),
+    cl::init(false)
+);
+
+namespace {
+
+struct Snapshot {
+    std::string pass;
+    std::string scope;
+    u64 malloc = 0;
+    u64 peak_rss = 0;
+    Array<std::pair<StringRef, u64>> owned;
+};
+
+}  // namespace
+
+/* Passes and analyses nest (an analysis requested inside a pass), so the snapshots are a stack.
+ * Passes running on the workers of Parallel(...) have no callbacks, their reports are dropped. */
+static thread_local std::vector<Snapshot> snapshots;
+
+static u64 peak_rss(void) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return (u64)usage.ru_maxrss * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static std::string scope_name(Any IR) {
+    if (auto *func = any_cast<const Function *>(&IR)) return (*func)->getName().str();
+    if (auto *loop = any_cast<const Loop *>(&IR)) return (*loop)->getName().str();
+    if (auto *module = any_cast<const Module *>(&IR)) return (*module)->getModuleIdentifier();
+    return "";
+}
+
+/* Pass managers and adaptors only contain the passes that are reported themselves. */
+static bool is_container_pass(StringRef pass) {
+    return pass.contains("PassManager") || pass.contains("PassAdaptor");
+}
+
+static void push_snapshot(StringRef pass, Any IR) {
+    if (is_container_pass(pass)) return;
+
+    Snapshot &snapshot = snapshots.emplace_back();
+    snapshot.pass = pass.str();
+    snapshot.scope = scope_name(IR);
+    snapshot.malloc = sys::Process::GetMallocUsage();
+    snapshot.peak_rss = peak_rss();
+}
+
+static void print_kib(raw_ostream &os, s64 bytes) {
+    os << (bytes >= 0 ? "+" : "-") << (u64)std::abs(bytes) / 1024 << " KiB";
+}
+
+static void pop_snapshot(StringRef pass) {
+    if (is_container_pass(pass) || snapshots.empty()) return;
+
+    Snapshot snapshot = std::move(snapshots.back());
+    snapshots.pop_back();
+
+    u64 malloc = sys::Process::GetMallocUsage();
+    u64 rss = peak_rss();
+    s64 malloc_delta = (s64)malloc - (s64)snapshot.malloc;
+    s64 rss_delta = (s64)rss - (s64)snapshot.peak_rss;
+
+    if (has_result_sink()) {
+        Record record("MemoryUsage", snapshot.scope);
+        record.add("pass", snapshot.pass)
+            .add("heap_delta", malloc_delta)
+            .add("heap", malloc)
+            .add("peak_rss_delta", rss_delta)
+            .add("peak_rss", rss);
+        for (auto [container, bytes] : snapshot.owned) {
+            record.add(container, bytes);
+        }
+        emit(record);
+        return;
+    }
+
+    out() << "[MemoryUsage] " << snapshot.pass << " on " << snapshot.scope << ": heap ";
+    print_kib(out(), malloc_delta);
+    out() << " (" << malloc / 1024 << " KiB), peak RSS ";
+    print_kib(out(), rss_delta);
+    out() << " (" << rss / 1024 << " KiB)";
+    for (auto [container, bytes] : snapshot.owned) {
+        out() << ", " << container << " " << bytes << " B";
+    }
+    out() << "\n";
+}
+
+void report_owned_memory(StringRef container, u64 bytes) {
+    if (!memory_usage || snapshots.empty()) return;
+    snapshots.back().owned.push_back({container, bytes});
+}
+
+void register_memory_usage_callbacks(PassInstrumentationCallbacks &PIC) {
+    if (!memory_usage) return;
+
+    PIC.registerBeforeNonSkippedPassCallback([](StringRef pass, Any IR) { push_snapshot(pass, IR); });
+    PIC.registerAfterPassCallback([](StringRef pass, Any, const PreservedAnalyses &) { pop_snapshot(pass); });
+    PIC.registerAfterPassInvalidatedCallback([](StringRef pass, const PreservedAnalyses &) { pop_snapshot(pass); });
+    PIC.registerBeforeAnalysisCallback([](StringRef analysis, Any IR) { push_snapshot(analysis, IR); });
+    PIC.registerAfterAnalysisCallback([](StringRef analysis, Any) { pop_snapshot(analysis); });
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassInstrumentation.h"
+
+#include "Common.hpp"
+
+/* Called by passes at the end of run() with the size of a container they keep between functions,
+ * so -memory-usage shows whether it keeps growing over the module. */
+void report_owned_memory(llvm::StringRef container, u64 bytes);
+
+/* With -memory-usage prints the growth of malloc'ed memory and peak RSS
+ * of every pass and analysis invocation, per function. */
+void register_memory_usage_callbacks(llvm::PassInstrumentationCallbacks &PIC);
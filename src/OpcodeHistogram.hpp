@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+
+#include "Common.hpp"
+
+/* Number of instructions (or any weight) per opcode. Opcodes are small dense integers,
+ * so this is a plain array and names are only looked up when printing. */
+template <typename T>
+struct OpcodeHistogram {
+    static constexpr u32 SIZE = llvm::Instruction::OtherOpsEnd;
+
+    std::array<T, SIZE> counts{};
+
+    T &operator[](u32 opcode) { return counts[opcode]; }
+    T operator[](u32 opcode) const { return counts[opcode]; }
+
+    void clear(void) { counts.fill(T()); }
+
+    OpcodeHistogram &operator+=(const OpcodeHistogram &other) {
+        for (u32 opcode = 0; opcode < SIZE; opcode++) {
+            counts[opcode] += other.counts[opcode];
+        }
+        return *this;
+    }
+
+    static const char *name(u32 opcode) { return llvm::Instruction::getOpcodeName(opcode); }
+};
+
+inline void count_opcodes(OpcodeHistogram<u32> &histogram, const llvm::Function &func) {
+    for (auto &bb : func) {
+        for (auto &instr : bb) {
+            histogram[instr.getOpcode()] += 1;
+        }
+    }
+}
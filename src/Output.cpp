@@ -0,0 +1,188 @@
+#include "Output.hpp"
+
+#include <mutex>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+
+using namespace llvm;
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_CSV,
+} OutputFormat;
+
+static cl::opt<std::string> output_file(
+    "custom-passes-output",
+    cl::desc("Write structured results of the passes to this file instead of free-form text"),
+    cl::value_desc("filename")
+);
+
+static cl::opt<OutputFormat> output_format(
+    "custom-passes-format",
+    cl::desc("Format of -custom-passes-output"),
+    cl::values(
+        clEnumValN(FORMAT_TEXT, "text", "One line per record: pass, function and key=value pairs"),
+        clEnumValN(FORMAT_JSONL, "jsonl", "One JSON object per record"),
+        clEnumValN(FORMAT_CSV, "csv", "One row per field: pass,function,record,key,value")
+    ),
+    cl::init(FORMAT_JSONL)
+);
+
+static thread_local raw_ostream *current_output = nullptr;
+
+/* Records of the same pass and function are numbered for CSV, so its rows can be grouped again.
+ * A function is always processed by a single thread, so the numbering is deterministic. */
+static thread_local struct {
+    StringRef pass;
+    std::string scope;
+    u32 index = 0;
+} record_numbering;
+
+static std::mutex file_lock;
+
+static raw_fd_ostream &result_file(void) {
+    static std::unique_ptr<raw_fd_ostream> file = [] {
+        std::error_code error;
+        auto file = std::make_unique<raw_fd_ostream>(output_file, error, sys::fs::OF_Text);
+        if (error) {
+            report_fatal_error(Twine("can not open ") + output_file + ": " + error.message());
+        }
+        if (output_format == FORMAT_CSV) {
+            *file << "pass,function,record,key,value\n";
+        }
+        return file;
+    }();
+    return *file;
+}
+
+bool has_result_sink(void) {
+    return !output_file.empty();
+}
+
+raw_ostream &out(void) {
+    if (has_result_sink()) return nulls();
+    return current_output ? *current_output : dbgs();
+}
+
+raw_ostream &output_target(void) {
+    if (!has_result_sink()) return out();
+    return current_output ? *current_output : result_file();
+}
+
+static void print_value(raw_ostream &os, const json::Value &value) {
+    if (auto string = value.getAsString()) {
+        os << *string;
+    } else if (auto boolean = value.getAsBoolean()) {
+        os << (*boolean ? "true" : "false");
+    } else if (auto integer = value.getAsInteger()) {
+        os << *integer;
+    } else if (auto unsigned_integer = value.getAsUINT64()) {
+        os << *unsigned_integer;
+    } else if (auto number = value.getAsNumber()) {
+        os << format("%g", *number);
+    }
+}
+
+static void print_csv_value(raw_ostream &os, const json::Value &value) {
+    auto string = value.getAsString();
+    if (!string || string->find_first_of(",\"\n") == StringRef::npos) {
+        print_value(os, value);
+        return;
+    }
+
+    os << '"';
+    for (char c : *string) {
+        if (c == '"') os << '"';
+        os << c;
+    }
+    os << '"';
+}
+
+static void write_record(raw_ostream &os, const Record &record) {
+    switch (output_format) {
+    case FORMAT_TEXT:
+        os << record.pass << " " << record.scope;
+        for (auto &field : record.fields) {
+            os << " " << field.key << "=";
+            print_value(os, field.value);
+        }
+        os << "\n";
+        break;
+
+    case FORMAT_JSONL: {
+        json::OStream json(os);
+        json.object([&] {
+            json.attribute("pass", record.pass);
+            json.attribute("function", record.scope);
+            for (auto &field : record.fields) {
+                json.attribute(field.key, field.value);
+            }
+        });
+        os << "\n";
+        break;
+    }
+
+    case FORMAT_CSV: {
+        if (record_numbering.pass != record.pass || record_numbering.scope != record.scope) {
+            record_numbering.pass = record.pass;
+            record_numbering.scope = record.scope;
+            record_numbering.index = 0;
+        }
+        u32 index = record_numbering.index++;
+
+        for (auto &field : record.fields) {
+            os << record.pass << ",";
+            print_csv_value(os, json::Value(record.scope));
+            os << "," << index << "," << field.key << ",";
+            print_csv_value(os, field.value);
+            os << "\n";
+        }
+        break;
+    }
+    }
+}
+
+void emit(const Record &record) {
+    if (!has_result_sink()) return;
+
+    if (current_output) {
+        write_record(*current_output, record);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(file_lock);
+    write_record(result_file(), record);
+}
+
+void replay_output(StringRef captured) {
+    if (!has_result_sink() || current_output) {
+        output_target() << captured;
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(file_lock);
+    result_file() << captured;
+}
+
+StringRef output_kind(void) {
+    if (!has_result_sink()) return "text";
+
+    switch (output_format) {
+    case FORMAT_TEXT: return "records";
+    case FORMAT_JSONL: return "jsonl";
+    case FORMAT_CSV: return "csv";
+    }
+    llvm_unreachable("unknown output format");
+}
+
+ScopedOutput::ScopedOutput(raw_ostream &os) : previous(current_output) {
+    current_output = &os;
+}
+
+ScopedOutput::~ScopedOutput() {
+    current_output = previous;
+}
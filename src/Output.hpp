@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+
+#include "llvm/IR/Function.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Common.hpp"
+
+/* Stream that all passes print free-form text to: dbgs(), unless the current thread
+ * redirected it. With a result sink (-custom-passes-output) the text is dropped. */
+llvm::raw_ostream &out(void);
+
+/* One structured result of a pass: the function (or module) it is about and named fields. */
+struct Record {
+    struct Field {
+        llvm::StringRef key;
+        llvm::json::Value value;
+    };
+
+    llvm::StringRef pass;
+    std::string scope;
+    Array<Field> fields;
+
+    Record(llvm::StringRef pass, const llvm::Function &func) : pass(pass), scope(func.getName()) {}
+    Record(llvm::StringRef pass, llvm::StringRef scope) : pass(pass), scope(scope) {}
+
+    Record &add(llvm::StringRef key, llvm::StringRef value) {
+        fields.push_back({key, value.str()});
+        return *this;
+    }
+
+    /* Without it string literals would be converted to bool. */
+    Record &add(llvm::StringRef key, const char *value) {
+        return add(key, llvm::StringRef(value));
+    }
+
+    Record &add(llvm::StringRef key, bool value) {
+        fields.push_back({key, value});
+        return *this;
+    }
+
+    /* Unsigned values stay unsigned, so counts above INT64_MAX do not wrap around. */
+    template <typename T>
+    std::enable_if_t<std::is_integral_v<T>, Record &> add(llvm::StringRef key, T value) {
+        if constexpr (std::is_unsigned_v<T>) {
+            fields.push_back({key, (uint64_t)value});
+        } else {
+            fields.push_back({key, (s64)value});
+        }
+        return *this;
+    }
+
+    Record &add(llvm::StringRef key, f64 value) {
+        fields.push_back({key, value});
+        return *this;
+    }
+
+    /* Anything printable, like instructions or SCEVs. */
+    template <typename T>
+    Record &add_printed(llvm::StringRef key, const T &value) {
+        std::string text;
+        llvm::raw_string_ostream os(text);
+        os << value;
+        fields.push_back({key, std::move(os.str())});
+        return *this;
+    }
+};
+
+/* True if -custom-passes-output is given, passes only build records in that case. */
+bool has_result_sink(void);
+
+/* Writes the record in the format of -custom-passes-format,
+ * to the stream redirected for the current thread or to the output file. */
+void emit(const Record &record);
+
+/* Where the output of the current thread ends up: the result file with a sink, out() otherwise. */
+llvm::raw_ostream &output_target(void);
+
+/* Writes output captured with ScopedOutput (text or records) to where it would have gone. */
+void replay_output(llvm::StringRef captured);
+
+/* "text" without a sink, otherwise the name of the record format. */
+llvm::StringRef output_kind(void);
+
+/* Redirects the output of the current thread (records with a sink, text otherwise)
+ * for the lifetime of the object, used to collect the output of a pass into a buffer. */
+struct ScopedOutput {
+    llvm::raw_ostream *previous;
+
+    explicit ScopedOutput(llvm::raw_ostream &os);
+    ~ScopedOutput();
+};
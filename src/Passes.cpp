@@ -1,80 +1,248 @@
+#include "Passes.hpp"
+
+#include <atomic>
+#include <mutex>
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/StructuralHash.h"
+#include "llvm/IRReader/IRReader.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/GraphWriter.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "AffineAccess.hpp"
+#include "AnalysisCache.hpp"
+#include "Common.hpp"
+#include "CriticalPath.hpp"
+#include "FunctionScratch.hpp"
+#include "FunctionSummary.hpp"
+#include "IVRange.hpp"
+#include "Inductions.hpp"
+#include "LoopCost.hpp"
 #include "LoopFuse.hpp"
-
-/* Signed numbers */
-typedef int8_t s8;
-typedef int16_t s16;
-typedef int32_t s32;
-typedef int64_t s64;
-
-/* Unsigned numbers */
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef uint64_t u64;
-
-/* Floating point numbers */
-typedef float f32;
-typedef double f64;
-typedef long double f80;
+#include "LoopProfile.hpp"
+#include "MemoryUsage.hpp"
+#include "OpcodeHistogram.hpp"
+#include "Output.hpp"
+#include "RegisterPressure.hpp"
+#include "StaticFrequency.hpp"
+#include "TripCount.hpp"
 
 using namespace llvm;
 
-template <typename T>
-using Array = SmallVector<T>;
+static cl::opt<bool> instr_count_static_freq(
+    "instr-count-static-freq",
+    cl::desc("Also print instruction counts weighted by the static block frequency"),
+    cl::init(false)
+);
+
+static cl::opt<bool> instr_count_cost(
+    "instr-count-cost",
+    cl::desc("Also print the TTI throughput cost of every opcode"),
+    cl::init(false)
+);
+
+static cl::opt<u32> instr_count_threads(
+    "instr-count-threads",
+    cl::desc("Number of threads counting the functions in ModuleInstrCount, 0 uses all cores"),
+    cl::init(1)
+);
+
+typedef enum {
+    RPO_PRINT_FULL,
+    RPO_PRINT_SUMMARY,
+    RPO_PRINT_RPO,
+    RPO_PRINT_SAMPLE,
+} RPOPrintMode;
+
+static cl::opt<RPOPrintMode> rpo_print_mode(
+    "rpo-print-mode",
+    cl::desc("What RPOPrint prints for every function"),
+    cl::values(
+        clEnumValN(RPO_PRINT_FULL, "full", "Every block with its first and last instructions, the RPO and back edges"),
+        clEnumValN(RPO_PRINT_SUMMARY, "summary", "Only the number of blocks, instructions and edges"),
+        clEnumValN(RPO_PRINT_RPO, "rpo", "Only the RPO and back edges"),
+        clEnumValN(RPO_PRINT_SAMPLE, "sample", "Like full, but only -rpo-print-sample-blocks blocks spread over the function")
+    ),
+    cl::init(RPO_PRINT_FULL)
+);
+
+static cl::opt<u32> rpo_print_max_instructions(
+    "rpo-print-max-instructions",
+    cl::desc("Number of instructions RPOPrint prints at the start and at the end of a block"),
+    cl::init(3)
+);
+
+static cl::opt<u32> rpo_print_sample_blocks(
+    "rpo-print-sample-blocks",
+    cl::desc("Number of blocks printed with -rpo-print-mode=sample"),
+    cl::init(16)
+);
+
+static cl::opt<std::string> cfg_dot_dir(
+    "cfg-dot-dir",
+    cl::desc("Directory CFGDot writes the cfg.<function>.dot files to"),
+    cl::value_desc("directory"),
+    cl::init(".")
+);
+
+static cl::opt<std::string> instr_diff_baseline(
+    "instr-diff-baseline",
+    cl::desc("Module that InstrDiff compares the opcode counts with, usually the input before the transforms"),
+    cl::value_desc("filename")
+);
+
+static cl::opt<u32> parallel_threads(
+    "parallel-threads",
+    cl::desc("Number of threads running the functions in Parallel(...), 0 uses all cores"),
+    cl::init(0)
+);
+
+/* The profiler of the main thread does not tell its granularity, so it is passed in here. */
+static cl::opt<u32> parallel_time_trace_granularity(
+    "parallel-time-trace-granularity",
+    cl::desc("Minimum time in microseconds of an event traced by the workers of Parallel(...), "
+             "usually the same as -time-trace-granularity"),
+    cl::init(500)
+);
 
 namespace {
 
 struct ArgPrintPass : PassInfoMixin<ArgPrintPass> {
     static bool isRequired(void) { return true; }
 
-    auto run(Function &func, FunctionAnalysisManager &) {
-        dbgs() << "\n[ArgPrint]\n";
-        dbgs() << "Function name: " << func.getName() << "\n";
-        dbgs() << "    # of arguments: " << func.arg_size() << "\n";
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("ArgPrint", func.getName());
+        out() << "\n[ArgPrint]\n";
+        out() << "Function name: " << func.getName() << "\n";
+        out() << "    # of arguments: " << func.arg_size() << "\n";
+
+        /* A function pass can not compute the module summaries, they are used when an earlier pass
+         * like SummaryAttrs left them cached. Otherwise calls are judged by their attributes only.
+         * A transform earlier in the same function pipeline can only abandon them once the pipeline is done,
+         * a summary of another size than the body is from before such a change. */
+        const FunctionSummary *summary = nullptr;
+        auto &MAM_proxy = AM.getResult<ModuleAnalysisManagerFunctionProxy>(func);
+        if (auto *info = MAM_proxy.getCachedResult<FunctionSummaryAnalysis>(*func.getParent())) {
+            summary = info->lookup(&func);
+            if (summary && summary->size != func.getInstructionCount()) summary = nullptr;
+        }
+
+        FunctionSummary local;
+        if (!summary) {
+            summarize_function(local, func, FunctionSummaryInfo());
+            summary = &local;
+        }
+
+        if (has_result_sink()) {
+            emit_summary("ArgPrint", *summary);
+        } else {
+            print_summary(out(), *summary);
+        }
 
         return PreservedAnalyses::all();
     }
 };
 
-const auto MAX_INSTRUCTIONS = 3;
+/* Text is collected here and written out in large chunks,
+ * as out() is usually the unbuffered dbgs(). */
+const u32 RPO_PRINT_FLUSH_SIZE = 1 << 16;
 
 struct RPOPrintPass : PassInfoMixin<RPOPrintPass> {
-    DenseMap<BasicBlock *, u32> block_ids;  // XXX:? Replace by llvm/IR/ValueMap.h
-    Array<BasicBlock *> blocks;  // XXX:? llvm/ADT/TinyPtrVector.h
+    FunctionScratch scratch;
+    DenseMap<BasicBlock *, u32> block_ids;
+    MutableArrayRef<BasicBlock *> blocks;
+    SmallString<0> text;
 
     static bool isRequired(void) { return true; }
 
     auto index_blocks(Function &func) {
-        blocks.clear();
-        blocks.resize_for_overwrite(func.size());
-        // block_ids.clear();  // This can potentially do memory reallocations, so just leave it as is
+        scratch.reset();
+        blocks = scratch.allocate<BasicBlock *>(func.size());
+        /* Keys of the previous function may be freed blocks by now,
+         * and clear() shrinks the buckets again after a large function. */
+        block_ids.clear();
+        block_ids.reserve(func.size());
         for (auto [id, bb] : enumerate(func)) {
             blocks[id] = &bb;
             block_ids[&bb] = id;
         }
     }
 
-    auto print_indexing() {
+    auto flush_text(bool force) {
+        if (!force && text.size() < RPO_PRINT_FLUSH_SIZE) return;
+        out() << text;
+        text.clear();
+    }
+
+    auto print_block(raw_ostream &os, u32 id) {
+        BasicBlock *bb = blocks[id];
+        os << "Basic block " << id << ": '" << bb->getName() << "'\n";
+
+        u64 max_instructions = rpo_print_max_instructions;
+        u64 size = bb->size();
+        for (auto [i, instr] : enumerate(*bb)) {
+            if (i < max_instructions || i + max_instructions >= size) {
+                os << instr << "\n";
+            } else if (i == max_instructions) {
+                os << "  ..." << "\n";
+            }
+        }
+        os << "\n";
+        flush_text(false);
+    }
+
+    auto print_indexing(raw_ostream &os) {
+        for (u32 id = 0; id < blocks.size(); id++) {
+            print_block(os, id);
+        }
+    }
+
+    /* Evenly spread blocks, the entry block is always the first one. */
+    auto print_sampled_indexing(raw_ostream &os) {
+        u32 samples = std::max(1u, (u32)rpo_print_sample_blocks);
+        u32 stride = divideCeil(blocks.size(), samples);
+        for (u32 id = 0; id < blocks.size(); id += stride) {
+            print_block(os, id);
+        }
+        if (stride > 1) {
+            os << "(" << divideCeil(blocks.size(), stride) << " of " << blocks.size() << " blocks)\n\n";
+        }
+    }
+
+    auto print_summary(raw_ostream &os, ArrayRef<u32> ordering, ArrayRef<std::tuple<u32, u32>> back_edges) {
+        u64 instructions = 0;
+        u64 edges = 0;
+        u32 largest = 0;
+        u64 largest_size = 0;
         for (auto [id, bb] : enumerate(blocks)) {
-            dbgs() << "Basic block " << id << ": '" << bb->getName() << "'\n";
-
-            auto close_to_end = bb->size() - MAX_INSTRUCTIONS;
-            for (auto [i, instr] : enumerate(*bb)) {
-                if (i < MAX_INSTRUCTIONS || i >= close_to_end) {
-                    dbgs() << instr << "\n";
-                } else if (i == MAX_INSTRUCTIONS) {
-                    dbgs() << "  ..." << "\n";
-                }
+            u64 size = bb->size();
+            instructions += size;
+            edges += bb->getTerminator()->getNumSuccessors();
+            if (size > largest_size) {
+                largest = id;
+                largest_size = size;
             }
-            dbgs() << "\n";
         }
+
+        os << "Blocks: " << blocks.size() << ", unreachable: " << blocks.size() - ordering.size() << "\n";
+        os << "Instructions: " << instructions << ", largest block " << largest << " with " << largest_size << "\n";
+        os << "Edges: " << edges << ", back edges: " << back_edges.size() << "\n";
     }
 
     auto calculate_rpo(Function &func, u32 root, Array<u32> &ordering, Array<std::tuple<u32, u32>> &back_edges) {
+        TimeTraceScope time_scope("calculate_rpo", func.getName());
         typedef enum {
             RPO_NEW,
             RPO_WAIT,
@@ -86,7 +254,7 @@ struct RPOPrintPass : PassInfoMixin<RPOPrintPass> {
 
         ordering.reserve(length);
 
-        Array<RPO_State> states(length);
+        MutableArrayRef<RPO_State> states = scratch.allocate<RPO_State>(length);
 
         Array<s64> stack;
         /* Large upper bound. Once for all of the nodes,
@@ -122,19 +290,25 @@ struct RPOPrintPass : PassInfoMixin<RPOPrintPass> {
                 continue;
             }
 
+            /* A block waiting on the stack can be pushed again by a later predecessor,
+             * only its topmost entry visits it. */
+            if (states[id] != RPO_WAIT) continue;
+
             /* Will be popped after all children are visited
              * thus post order. */
             stack.push_back(id - length);
             states[id] = RPO_SEEN;
 
+            /* Only blocks on the current path are SEEN, an edge to one of them closes a cycle.
+             * Edges to DONE blocks are forward or cross edges. */
             auto term = blocks[id]->getTerminator();
             auto end = term->getNumSuccessors();
             for (u32 i = 0; i < end; ++i) {
                 auto child = block_ids[term->getSuccessor(i)];
                 RPO_State s = states[child];
-                if (s == RPO_WAIT || s == RPO_SEEN) {
+                if (s == RPO_SEEN) {
                     back_edges.push_back({id, child});
-                } else if (s == RPO_NEW) {
+                } else if (s == RPO_NEW || s == RPO_WAIT) {
                     states[child] = RPO_WAIT;
                     stack.push_back((s64)child);
                 }
@@ -144,24 +318,176 @@ struct RPOPrintPass : PassInfoMixin<RPOPrintPass> {
         std::reverse(std::begin(ordering), std::end(ordering));
     }
 
-    auto run(Function &func, FunctionAnalysisManager &) {
-        dbgs() << "\n[RPOPrint]\n";
-        dbgs() << "Function: " << func.getName() << "\n\n";
+    auto emit_records(Function &func, ArrayRef<u32> ordering, ArrayRef<std::tuple<u32, u32>> back_edges) {
+        for (auto [position, id] : enumerate(ordering)) {
+            emit(Record("RPOPrint", func)
+                .add("block", id)
+                .add("name", blocks[id]->getName())
+                .add("rpo", position)
+                .add("instructions", blocks[id]->size()));
+        }
+        for (auto [src, dst] : back_edges) {
+            emit(Record("RPOPrint", func).add("back_edge_src", src).add("back_edge_dst", dst));
+        }
+    }
 
-        index_blocks(func);
+    auto print_text(Function &func, ArrayRef<u32> ordering, ArrayRef<std::tuple<u32, u32>> back_edges) {
+        raw_svector_ostream os(text);
+
+        os << "\n[RPOPrint]\n";
+        os << "Function: " << func.getName() << "\n\n";
 
-        print_indexing();
+        if (rpo_print_mode == RPO_PRINT_FULL) {
+            print_indexing(os);
+        } else if (rpo_print_mode == RPO_PRINT_SAMPLE) {
+            print_sampled_indexing(os);
+        }
+
+        if (rpo_print_mode == RPO_PRINT_SUMMARY) {
+            print_summary(os, ordering, back_edges);
+        } else {
+            os << "RPO: ";
+            for (auto id : ordering) {
+                os << id << " ";
+                flush_text(false);
+            }
+            os << "\n";
+            for (auto [src, dst] : back_edges) {
+                os << "Back edge:" << dst << "<-" << src << "\n";
+                flush_text(false);
+            }
+        }
+        flush_text(true);
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &) {
+        TimeTraceScope time_scope("RPOPrint", func.getName());
+        index_blocks(func);
 
         Array<u32> ordering;
         Array<std::tuple<u32, u32>> back_edges;
         calculate_rpo(func, std::distance(func.begin(), func.getEntryBlock().getIterator()), ordering, back_edges);
-        dbgs() << "RPO: ";
-        for (auto id : ordering) {
-            dbgs() << id << " ";
+
+        text.clear();
+        if (has_result_sink()) {
+            emit_records(func, ordering, back_edges);
+        } else {
+            print_text(func, ordering, back_edges);
         }
-        dbgs() << "\n";
+
+        report_owned_memory("block_ids", block_ids.getMemorySize());
+        report_owned_memory("scratch", scratch.allocator.getTotalMemory());
+        report_owned_memory("text", text.capacity_in_bytes());
+
+        return PreservedAnalyses::all();
+    }
+};
+
+/* Writes the CFG of every function as Graphviz, with the blocks labeled by their RPO index,
+ * back edges in red, loops as nested clusters and edges weighted by the static frequency.
+ * The file is written while walking the function, so large functions never build a graph in memory. */
+struct CFGDotPass : PassInfoMixin<CFGDotPass> {
+    RPOPrintPass rpo;
+    Array<u32> positions;
+
+    static bool isRequired(void) { return true; }
+
+    void write_block(raw_ostream &os, u32 id, u32 indent) {
+        BasicBlock *bb = rpo.blocks[id];
+        os.indent(indent) << "n" << id << " [label=\"";
+        if (positions[id] == ~0u) {
+            os << "unreachable";
+        } else {
+            os << "#" << positions[id];
+        }
+        os << "\\n" << DOT::EscapeString(bb->getName().str()) << "\"];\n";
+    }
+
+    void write_loop(raw_ostream &os, Loop *loop, LoopInfo &LI, u32 indent) {
+        u32 depth = loop->getLoopDepth();
+        os.indent(indent) << "subgraph cluster_" << rpo.block_ids.lookup(loop->getHeader()) << " {\n";
+        os.indent(indent + 2) << "label=\"loop " << DOT::EscapeString(loop->getName().str())
+            << " (depth " << depth << ")\";\n";
+        os.indent(indent + 2) << "style=filled;\n";
+        os.indent(indent + 2) << "fillcolor=gray" << std::max(40u, 100 - 10 * depth) << ";\n";
+
+        for (BasicBlock *bb : loop->blocks()) {
+            if (LI.getLoopFor(bb) == loop) write_block(os, rpo.block_ids.lookup(bb), indent + 2);
+        }
+        for (Loop *sub_loop : loop->getSubLoops()) {
+            write_loop(os, sub_loop, LI, indent + 2);
+        }
+        os.indent(indent) << "}\n";
+    }
+
+    void write_graph(raw_ostream &os, Function &func, LoopInfo &LI, const StaticFrequencyInfo &SF,
+                     ArrayRef<std::tuple<u32, u32>> back_edges) {
+        std::string title = DOT::EscapeString(("CFG for '" + func.getName() + "'").str());
+        os << "digraph \"" << title << "\" {\n";
+        os << "  label=\"" << title << "\";\n";
+        os << "  node [shape=box];\n";
+
+        for (auto [id, bb] : enumerate(rpo.blocks)) {
+            if (!LI.getLoopFor(bb)) write_block(os, id, 2);
+        }
+        for (Loop *loop : LI) {
+            write_loop(os, loop, LI, 2);
+        }
+
+        DenseSet<std::pair<u32, u32>> back;
         for (auto [src, dst] : back_edges) {
-            dbgs() << "Back edge:" << dst << "<-" << src << "\n";
+            back.insert({src, dst});
+        }
+
+        f64 max_frequency = std::max(SF.max_frequency, 1.0);
+        for (auto [src, bb] : enumerate(rpo.blocks)) {
+            for (BasicBlock *succ : successors(bb)) {
+                u32 dst = rpo.block_ids.lookup(succ);
+                f64 frequency = SF.edge_frequency(bb, succ);
+
+                os << "  n" << src << " -> n" << dst << " [label=\"" << format("%.2f", frequency) << "\""
+                    << ", penwidth=" << format("%.2f", 1 + 4 * std::min(frequency / max_frequency, 1.0));
+                if (back.contains({(u32)src, dst})) {
+                    os << ", color=red, constraint=false";
+                }
+                os << "];\n";
+            }
+        }
+        os << "}\n";
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("CFGDot", func.getName());
+        out() << "\n[CFGDot]\n";
+
+        auto &LI = AM.getResult<LoopAnalysis>(func);
+        auto &SF = AM.getResult<StaticFrequencyAnalysis>(func);
+
+        rpo.index_blocks(func);
+        Array<u32> ordering;
+        Array<std::tuple<u32, u32>> back_edges;
+        rpo.calculate_rpo(func, std::distance(func.begin(), func.getEntryBlock().getIterator()), ordering, back_edges);
+
+        positions.assign(rpo.blocks.size(), ~0u);
+        for (auto [position, id] : enumerate(ordering)) {
+            positions[id] = position;
+        }
+
+        SmallString<128> path(cfg_dot_dir);
+        sys::path::append(path, "cfg." + func.getName() + ".dot");
+
+        std::error_code error;
+        raw_fd_ostream file(path, error, sys::fs::OF_Text);
+        if (error) {
+            errs() << "CFGDot: can not write " << path << ": " << error.message() << "\n";
+            return PreservedAnalyses::all();
+        }
+        write_graph(file, func, LI, SF, back_edges);
+
+        if (has_result_sink()) {
+            emit(Record("CFGDot", func).add("file", path.str()).add("back_edges", back_edges.size()));
+        } else {
+            out() << "Function " << func.getName() << "(): written to " << path << "\n";
         }
 
         return PreservedAnalyses::all();
@@ -169,58 +495,369 @@ struct RPOPrintPass : PassInfoMixin<RPOPrintPass> {
 };
 
 struct InstructionCounterPass : PassInfoMixin<InstructionCounterPass> {
-    StringMap<u32> counts;
+    OpcodeHistogram<u32> counts;
+    /* Expected dynamic counts per call, only filled with -instr-count-static-freq. */
+    OpcodeHistogram<f64> weighted;
+    bool has_weighted = false;
+    /* Throughput cost, static and per call, only filled with -instr-count-cost. */
+    OpcodeHistogram<s64> costs;
+    OpcodeHistogram<f64> weighted_costs;
+    bool has_costs = false;
 
     static bool isRequired(void) { return true; }
 
     auto count(Function &func) {
         counts.clear();
+        count_opcodes(counts, func);
+    }
+
+    auto count_weighted(Function &func, const StaticFrequencyInfo &SF) {
+        weighted.clear();
         for (auto &bb : func) {
+            f64 frequency = SF.frequency(&bb);
             for (auto &instr : bb) {
-                counts[instr.getOpcodeName()] += 1;
+                weighted[instr.getOpcode()] += frequency;
             }
         }
     }
 
-    auto print() {
-        for (auto &[name, count] : counts) {
-            dbgs() << "  " << name << ": " << count << "\n";
+    auto count_cost(Function &func, const TargetTransformInfo &TTI, const StaticFrequencyInfo *SF) {
+        costs.clear();
+        weighted_costs.clear();
+        for (auto &bb : func) {
+            for (auto &instr : bb) {
+                s64 cost = get_instruction_cost(instr, TTI, TargetTransformInfo::TCK_RecipThroughput);
+                costs[instr.getOpcode()] += cost;
+                if (SF) {
+                    weighted_costs[instr.getOpcode()] += SF->frequency(&bb) * cost;
+                }
+            }
         }
     }
 
-    auto run(Function &func, FunctionAnalysisManager &) {
-        dbgs() << "\n[InstrCount]\n";
-        dbgs() << "Function " << func.getName() << "():\n";
+    auto emit_records(Function &func) {
+        for (u32 opcode = 0; opcode < counts.SIZE; opcode++) {
+            if (!counts[opcode]) continue;
+
+            Record record("InstrCount", func);
+            record.add("opcode", counts.name(opcode)).add("count", counts[opcode]);
+            if (has_weighted) record.add("per_call", weighted[opcode]);
+            if (has_costs) record.add("cost", costs[opcode]);
+            if (has_costs && has_weighted) record.add("cycles_per_call", weighted_costs[opcode]);
+            emit(record);
+        }
+    }
+
+    auto print(void) {
+        s64 total_cost = 0;
+        f64 total_cycles = 0;
+        for (u32 opcode = 0; opcode < counts.SIZE; opcode++) {
+            if (!counts[opcode]) continue;
+
+            out() << "  " << counts.name(opcode) << ": " << counts[opcode];
+            if (has_weighted) {
+                out() << " (~" << format("%.2f", weighted[opcode]) << " per call)";
+            }
+            if (has_costs) {
+                out() << ", cost " << costs[opcode];
+                total_cost += costs[opcode];
+                if (has_weighted) {
+                    out() << " (~" << format("%.2f", weighted_costs[opcode]) << " cycles per call)";
+                    total_cycles += weighted_costs[opcode];
+                }
+            }
+            out() << "\n";
+        }
+
+        if (has_costs) {
+            out() << "  Total cost: " << total_cost;
+            if (has_weighted) {
+                out() << " (~" << format("%.2f", total_cycles) << " cycles per call)";
+            }
+            out() << "\n";
+        }
+    }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("InstrCount", func.getName());
+        out() << "\n[InstrCount]\n";
+        out() << "Function " << func.getName() << "():\n";
 
         count(func);
-        print();
+        const StaticFrequencyInfo *SF = nullptr;
+        has_weighted = instr_count_static_freq;
+        if (has_weighted) {
+            SF = &AM.getResult<StaticFrequencyAnalysis>(func);
+            count_weighted(func, *SF);
+        }
+        has_costs = instr_count_cost;
+        if (has_costs) {
+            count_cost(func, AM.getResult<TargetIRAnalysis>(func), SF);
+        }
+        if (has_result_sink()) {
+            emit_records(func);
+        } else {
+            print();
+        }
 
         return PreservedAnalyses::all();
     }
 };
 
+/* Opcode histogram of the whole module. Counting only reads the IR,
+ * so with -instr-count-threads every thread counts its share of the functions
+ * into its own histogram and they are merged at the end. */
+struct ModuleInstructionCounterPass : PassInfoMixin<ModuleInstructionCounterPass> {
+    static bool isRequired(void) { return true; }
+
+    auto run(Module &module, ModuleAnalysisManager &) {
+        TimeTraceScope time_scope("ModuleInstrCount", module.getModuleIdentifier());
+        out() << "\n[ModuleInstrCount]\n";
+        out() << "Module " << module.getModuleIdentifier() << ":\n";
+
+        Array<const Function *> functions;
+        for (auto &func : module) {
+            if (!func.isDeclaration()) functions.push_back(&func);
+        }
+
+        OpcodeHistogram<u32> total;
+        if (instr_count_threads == 1) {
+            for (const Function *func : functions) {
+                count_opcodes(total, *func);
+            }
+        } else {
+            ThreadPool pool(hardware_concurrency(instr_count_threads));
+            u32 threads = pool.getThreadCount();
+
+            std::vector<OpcodeHistogram<u32>> partial(threads);
+            for (u32 thread = 0; thread < threads; thread++) {
+                pool.async([&, thread] {
+                    for (u32 i = thread; i < functions.size(); i += threads) {
+                        count_opcodes(partial[thread], *functions[i]);
+                    }
+                });
+            }
+            pool.wait();
+
+            for (auto &histogram : partial) {
+                total += histogram;
+            }
+        }
+
+        u64 instructions = 0;
+        for (u32 opcode = 0; opcode < total.SIZE; opcode++) {
+            if (!total[opcode]) continue;
+
+            instructions += total[opcode];
+            if (has_result_sink()) {
+                emit(Record("ModuleInstrCount", module.getModuleIdentifier())
+                    .add("opcode", total.name(opcode))
+                    .add("count", total[opcode]));
+            } else {
+                out() << "  " << total.name(opcode) << ": " << total[opcode] << "\n";
+            }
+        }
+        if (has_result_sink()) {
+            emit(Record("ModuleInstrCount", module.getModuleIdentifier())
+                .add("instructions", instructions)
+                .add("functions", functions.size()));
+        } else {
+            out() << "  Total: " << instructions << " instructions in " << functions.size() << " functions\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+/* Opcode counts of every function against the same function of a baseline module,
+ * to see what the transforms changed without diffing the IR by hand.
+ * Functions are paired by name first, the rest by the structural hash,
+ * so functions that only were renamed still pair up. */
+struct InstructionDiffPass : PassInfoMixin<InstructionDiffPass> {
+    struct CountedFunction {
+        std::string name;
+        u64 hash;
+        OpcodeHistogram<u32> histogram;
+        bool matched = false;
+    };
+
+    static bool isRequired(void) { return true; }
+
+    static void count_module(std::vector<CountedFunction> &counted, const Module &module) {
+        for (auto &func : module) {
+            if (func.isDeclaration()) continue;
+
+            auto &entry = counted.emplace_back();
+            entry.name = func.getName().str();
+            entry.hash = StructuralHash(func);
+            count_opcodes(entry.histogram, func);
+        }
+    }
+
+    /* Pairs every current function with a baseline one, or with -1 if there is none. */
+    static Array<s32> match_functions(std::vector<CountedFunction> &baseline, ArrayRef<CountedFunction> current) {
+        Array<s32> matches(current.size(), -1);
+
+        StringMap<u32> by_name;
+        for (auto [index, entry] : enumerate(baseline)) {
+            by_name[entry.name] = index;
+        }
+        for (auto [index, entry] : enumerate(current)) {
+            auto it = by_name.find(entry.name);
+            if (it == by_name.end()) continue;
+            matches[index] = it->second;
+            baseline[it->second].matched = true;
+        }
+
+        DenseMap<u64, Array<u32>> by_hash;
+        for (auto [index, entry] : enumerate(baseline)) {
+            if (!entry.matched) by_hash[entry.hash].push_back(index);
+        }
+        for (auto [index, entry] : enumerate(current)) {
+            if (matches[index] != -1) continue;
+
+            auto it = by_hash.find(entry.hash);
+            if (it == by_hash.end() || it->second.empty()) continue;
+            matches[index] = it->second.pop_back_val();
+            baseline[matches[index]].matched = true;
+        }
+
+        return matches;
+    }
+
+    static void print_delta(
+        StringRef scope, StringRef baseline_name, const OpcodeHistogram<u32> &before, const OpcodeHistogram<u32> &after
+    ) {
+        for (u32 opcode = 0; opcode < before.SIZE; opcode++) {
+            if (before[opcode] == after[opcode]) continue;
+
+            s64 delta = (s64)after[opcode] - (s64)before[opcode];
+            if (has_result_sink()) {
+                Record record("InstrDiff", scope);
+                if (!baseline_name.empty() && baseline_name != scope) record.add("baseline", baseline_name);
+                emit(record
+                    .add("opcode", before.name(opcode))
+                    .add("before", before[opcode])
+                    .add("after", after[opcode])
+                    .add("delta", delta));
+                continue;
+            }
+
+            out() << "  " << before.name(opcode) << ": " << before[opcode] << " -> " << after[opcode]
+                << " (" << (delta > 0 ? "+" : "") << delta << ")\n";
+        }
+    }
+
+    auto run(Module &module, ModuleAnalysisManager &) {
+        TimeTraceScope time_scope("InstrDiff", module.getModuleIdentifier());
+        out() << "\n[InstrDiff]\n";
+
+        LLVMContext context;
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> baseline_module = parseIRFile(instr_diff_baseline, diagnostic, context);
+        if (!baseline_module) {
+            diagnostic.print("InstrDiff", errs());
+            report_fatal_error("InstrDiff needs a readable -instr-diff-baseline module");
+        }
+
+        std::vector<CountedFunction> baseline;
+        std::vector<CountedFunction> current;
+        count_module(baseline, *baseline_module);
+        count_module(current, module);
+        Array<s32> matches = match_functions(baseline, current);
+
+        OpcodeHistogram<u32> empty;
+        OpcodeHistogram<u32> total_before;
+        OpcodeHistogram<u32> total_after;
+        for (auto [index, entry] : enumerate(current)) {
+            const CountedFunction *old = matches[index] == -1 ? nullptr : &baseline[matches[index]];
+            const OpcodeHistogram<u32> &before = old ? old->histogram : empty;
+
+            total_after += entry.histogram;
+            if (old) total_before += old->histogram;
+            if (old && before.counts == entry.histogram.counts) continue;
+
+            out() << "Function " << entry.name << "()";
+            if (!old) {
+                out() << " (added)";
+            } else if (old->name != entry.name) {
+                out() << " (was " << old->name << "())";
+            }
+            out() << ":\n";
+            print_delta(entry.name, old ? StringRef(old->name) : StringRef(), before, entry.histogram);
+        }
+
+        for (auto &old : baseline) {
+            if (old.matched) continue;
+
+            total_before += old.histogram;
+            out() << "Function " << old.name << "() (removed):\n";
+            print_delta(old.name, old.name, old.histogram, empty);
+        }
+
+        out() << "Module " << module.getModuleIdentifier() << ":\n";
+        print_delta(module.getModuleIdentifier(), StringRef(), total_before, total_after);
+
+        return PreservedAnalyses::all();
+    }
+};
 
 struct TripCountPass : PassInfoMixin<TripCountPass> {
     static bool isRequired(void) { return true; }
 
     auto run(Function &func, FunctionAnalysisManager &AM) {
-        dbgs() << "\n[TripCount]\n";
-        dbgs() << "Function " << func.getName() << "():\n";
+        TimeTraceScope time_scope("TripCount", func.getName());
+        out() << "\n[TripCount]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &TC = AM.getResult<TripCountAnalysis>(func);
+
+        for (auto &entry : TC.loops) {
+            if (has_result_sink()) {
+                emit(Record("TripCount", func)
+                    .add("loop", entry.loop->getName())
+                    .add("depth", entry.depth)
+                    .add("trip_count", entry.exact)
+                    .add("max_trip_count", entry.max)
+                    .add("trip_multiple", entry.multiple)
+                    .add_printed("backedge_taken", *entry.backedge_taken)
+                    .add_printed("iteration_space", *entry.space));
+                continue;
+            }
 
-        auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
-        auto &LA = AM.getResult<LoopAnalysis>(func);
+            auto &os = out().indent((entry.depth - 1) * 2);
+            os << "Loop at " << entry.loop->getName() << "' (depth " << entry.depth << "): ";
+            if (entry.exact) {
+                os << "Trip count = " << entry.exact << "\n";
+            } else {
+                os << "Unable to compute trip count\n";
+            }
 
-        for (const Loop *loop : LA) {
-            // auto *header = loop->getHeader();
-            const SCEV *trip_count = SE.getBackedgeTakenCount(loop);
-            trip_count->print(dbgs());
-            dbgs() << "\n";
-            if (const auto *C = dyn_cast<const SCEVConstant>(trip_count)) {
-                auto count = C->getValue()->getZExtValue();
-                dbgs() << "Loop at " << loop->getName() << "': Trip count = " << count << "\n";
+            out().indent(entry.depth * 2) << "Backedge taken: " << *entry.backedge_taken << "\n";
+            out().indent(entry.depth * 2) << "Max trip count: ";
+            if (entry.max) {
+                out() << entry.max;
             } else {
-                dbgs() << "Loop at " << loop->getName() << "': Unable to compute trip count\n";
+                out() << "unknown";
             }
+            out() << ", trip multiple: " << entry.multiple << "\n";
+            out().indent(entry.depth * 2) << "Iteration space: " << *entry.space << "\n";
+        }
+
+        for (auto &nest : TC.nests) {
+            if (has_result_sink()) {
+                emit(Record("TripCount", func)
+                    .add("nest", nest.loop->getName())
+                    .add_printed("iterations", *nest.iterations)
+                    .add("max_iterations", nest.max_iterations));
+                continue;
+            }
+
+            out() << "Nest at " << nest.loop->getName() << "': " << *nest.iterations << " iterations";
+            if (nest.max_iterations) {
+                out() << ", at most " << nest.max_iterations;
+            }
+            out() << "\n";
         }
 
         return PreservedAnalyses::all();
@@ -231,47 +868,75 @@ struct InductionsPass : PassInfoMixin<InductionsPass> {
     static bool isRequired(void) { return true; }
 
     auto run(Function &func, FunctionAnalysisManager &AM) {
-        dbgs() << "\n[Inductions]\n";
-        dbgs() << "Function " << func.getName() << "():\n";
+        TimeTraceScope time_scope("Inductions", func.getName());
+        out() << "\n[Inductions]\n";
+        out() << "Function " << func.getName() << "():\n";
 
         auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
-        auto &LA = AM.getResult<LoopAnalysis>(func);
+        auto &IA = AM.getResult<InductionAnalysis>(func);
 
-        for (const Loop *loop : LA) {
+        for (auto &inductions : IA.loops) {
+            const Loop *loop = inductions.loop;
             // loop->setLoopPreheader();
-            dbgs() << "Loop at " << *loop->getHeader()->getFirstNonPHI() << ":\n";
+            if (!has_result_sink()) {
+                out() << "Loop at " << *loop->getHeader()->getFirstNonPHI() << " (depth " << loop->getLoopDepth() << "):\n";
+            }
 
-            for (PHINode &phi : loop->getHeader()->phis()) {
-                // Check if the PHI node is an induction variable.
-                if (!(SE.isSCEVable(phi.getType()) && SE.getSCEV(&phi)->getSCEVType() == scAddRecExpr)) continue;
+            for (auto &variable : inductions.variables) {
+                const SCEVAddRecExpr *AR = variable.evolution;
+
+                if (has_result_sink()) {
+                    const char *kinds[] = {"basic", "pointer", "derived"};
+                    emit(Record("Inductions", func)
+                        .add("loop", loop->getName())
+                        .add("depth", loop->getLoopDepth())
+                        .add("kind", kinds[variable.kind])
+                        .add("variable", variable.instr->getName())
+                        .add_printed("evolution", *AR)
+                        .add_printed("start", *AR->getStart())
+                        .add_printed("step", *AR->getStepRecurrence(SE)));
+                    continue;
+                }
 
-                const SCEVAddRecExpr *AR = cast<SCEVAddRecExpr>(SE.getSCEV(&phi));
+                if (variable.kind == InductionVariable::IV_DERIVED) {
+                    out() << "  Derived induction variable: " << *variable.instr << "\n";
+                    out() << "    Evolution: " << *AR << "\n";
+                    if (variable.basic) {
+                        out() << "    = " << *variable.scale << " * %" << variable.basic->getName()
+                               << " + " << *variable.offset << "\n";
+                    }
+                    continue;
+                }
 
-                dbgs() << "  Induction variable: " << phi << "\n";
+                if (variable.kind == InductionVariable::IV_POINTER) {
+                    out() << "  Pointer induction variable: " << *variable.instr << "\n";
+                } else {
+                    out() << "  Induction variable: " << *variable.instr << "\n";
+                }
 
                 // Get the start value of the induction variable.
                 const SCEV *Start = AR->getStart();
-                dbgs() << "    Start: " << *Start << " = ";
+                out() << "    Start: " << *Start << " = ";
                 if (auto *ConstStart = dyn_cast<SCEVConstant>(Start)) {
-                  dbgs() << ConstStart->getValue()->getSExtValue() << "\n";
+                  out() << ConstStart->getValue()->getSExtValue() << "\n";
                 } else {
-                  dbgs() << "Not a constant\n";
+                  out() << "Not a constant\n";
                 }
 
                 // Get the step value of the induction variable.
                 const SCEV *Step = AR->getStepRecurrence(SE);
-                dbgs() << "    Step: " << *Step << " = ";
+                out() << "    Step: " << *Step << " = ";
                 if (auto *ConstStep = dyn_cast<SCEVConstant>(Step)) {
-                  dbgs() << ConstStep->getValue()->getSExtValue() << "\n";
+                  out() << ConstStep->getValue()->getSExtValue() << "\n";
                 } else {
-                  dbgs() << "Not a constant\n";
+                  out() << "Not a constant\n";
                 }
 
                 // You can also get the trip count of the loop if it's known:
                 if (const SCEVConstant *TripCount = dyn_cast_or_null<SCEVConstant>(SE.getBackedgeTakenCount(loop))) {
-                  dbgs() << "    Trip count: " << TripCount->getValue()->getSExtValue() << "\n";
+                  out() << "    Trip count: " << TripCount->getValue()->getSExtValue() << "\n";
                 } else {
-                  dbgs() << "    Trip count: Unknown\n";
+                  out() << "    Trip count: Unknown\n";
                 }
             }
         }
@@ -285,8 +950,9 @@ struct LoopPass : PassInfoMixin<LoopPass> {
     static bool isRequired(void) { return true; }
 
     auto run(Function &func, FunctionAnalysisManager &AM) {
-        dbgs() << "\n[Loop]\n";
-        dbgs() << "Function " << func.getName() << "():\n";
+        TimeTraceScope time_scope("Loop", func.getName());
+        out() << "\n[Loop]\n";
+        out() << "Function " << func.getName() << "():\n";
 
         auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
         auto &LA = AM.getResult<LoopAnalysis>(func);
@@ -299,31 +965,40 @@ struct LoopPass : PassInfoMixin<LoopPass> {
     }
 
     void printLoopHierarchy(Loop *loop, int depth, ScalarEvolution &SE) {
-        dbgs().indent(depth * 2) << "<loop at depth " << depth;
-
         InductionDescriptor induction;
-        if (loop->getInductionDescriptor(SE, induction)) {
-            dbgs() << "; induction = " << induction.getStep();
-        } else {
-            dbgs() << "; induction is unknown";
-        }
-
+        bool has_induction = loop->getInductionDescriptor(SE, induction);
         PHINode *induction_var = loop->getInductionVariable(SE);
-        if (induction_var) {
-            dbgs() << "; induction_var" << *induction_var;
-        } else {
-            dbgs() << "; no induction_var";
-        }
-
         auto bounds = loop->getBounds(SE);
 
-        if (bounds) {
-            dbgs() << "; yes bounds";
+        if (has_result_sink()) {
+            Record record("Loop", *loop->getHeader()->getParent());
+            record.add("loop", loop->getName()).add("depth", depth).add("bounds", (bool)bounds);
+            if (induction.getStep()) record.add_printed("induction_step", *induction.getStep());
+            if (induction_var) record.add("induction_var", induction_var->getName());
+            emit(record);
         } else {
-            dbgs() << "; no bounds";
-        }
+            out().indent(depth * 2) << "<loop at depth " << depth;
 
-        dbgs() << "> {\n";
+            if (has_induction) {
+                out() << "; induction = " << induction.getStep();
+            } else {
+                out() << "; induction is unknown";
+            }
+
+            if (induction_var) {
+                out() << "; induction_var" << *induction_var;
+            } else {
+                out() << "; no induction_var";
+            }
+
+            if (bounds) {
+                out() << "; yes bounds";
+            } else {
+                out() << "; no bounds";
+            }
+
+            out() << "> {\n";
+        }
 
         // bool isLoopSimplifyForm() const;
 
@@ -331,48 +1006,227 @@ struct LoopPass : PassInfoMixin<LoopPass> {
             printLoopHierarchy(sub_loop, depth + 1, SE);
         }
 
-        dbgs().indent(depth * 2) << "}\n";
+        if (!has_result_sink()) {
+            out().indent(depth * 2) << "}\n";
+        }
     }
 };
 
 } /*namespace*/
 
-auto register_passes(StringRef pass_name, FunctionPassManager &FPM, ...) {
+bool register_passes(StringRef pass_name, FunctionPassManager &FPM, ...) {
     if (pass_name == "ArgPrint") {
         FPM.addPass(ArgPrintPass());
         return true;
     }
     if (pass_name == "RPOPrint") {
-        FPM.addPass(RPOPrintPass());
+        std::string options;
+        raw_string_ostream(options) << (u32)rpo_print_mode << ',' << rpo_print_max_instructions << ','
+            << rpo_print_sample_blocks;
+        add_cacheable_pass(FPM, "RPOPrint", RPOPrintPass(), options);
+        return true;
+    }
+    if (pass_name == "CFGDot") {
+        FPM.addPass(CFGDotPass());
         return true;
     }
     if (pass_name == "InstrCount") {
-        FPM.addPass(InstructionCounterPass());
+        std::string options;
+        raw_string_ostream(options) << instr_count_static_freq << ',' << instr_count_cost << ','
+            << static_frequency_options();
+        add_cacheable_pass(FPM, "InstrCount", InstructionCounterPass(), options);
         return true;
     }
     if (pass_name == "TripCount") {
-        FPM.addPass(TripCountPass());
+        add_cacheable_pass(FPM, "TripCount", TripCountPass());
         return true;
     }
     if (pass_name == "Inductions") {
-        FPM.addPass(InductionsPass());
+        add_cacheable_pass(FPM, "Inductions", InductionsPass());
         return true;
     }
     if (pass_name == "Loop") {
-        FPM.addPass(LoopPass());
+        add_cacheable_pass(FPM, "Loop", LoopPass());
         return true;
     }
     return false;
 };
 
+typedef bool (*FunctionPassRegistry)(StringRef pass_name, FunctionPassManager &FPM, ...);
+
+const FunctionPassRegistry function_pass_registries[] = {
+    register_passes,
+    register_fuse_pass,
+    register_affine_access_pass,
+    register_static_frequency_pass,
+    register_induction_pass,
+    register_iv_range_pass,
+    register_loop_cost_pass,
+    register_register_pressure_pass,
+    register_critical_path_pass,
+};
+
+bool register_function_pass(StringRef pass_name, FunctionPassManager &FPM) {
+    for (auto registry : function_pass_registries) {
+        if (registry(pass_name, FPM)) return true;
+    }
+    return false;
+}
+
+namespace {
+
+/* Passes that only read the IR. Everything that builds SCEV, BPI or TTI is excluded,
+ * as those create constants or value handles in the LLVMContext, which is not thread-safe. */
+bool is_thread_safe(StringRef pass_name) {
+    if (pass_name == "ArgPrint" || pass_name == "RPOPrint") return true;
+    if (pass_name == "InstrCount") return !instr_count_static_freq && !instr_count_cost;
+    return false;
+}
+
+/* Runs read-only function passes, like Parallel(ArgPrint,RPOPrint,InstrCount),
+ * over the functions of the module on a thread pool. Each worker has its own
+ * pass instances and FunctionAnalysisManager, and prints into a buffer per function.
+ * The buffers are flushed in the order of the functions, as soon as all before them are done.
+ * Other passes, like TripCount or the transforms, are rejected when the pipeline is parsed. */
+struct ParallelPass : PassInfoMixin<ParallelPass> {
+    Array<std::string> pass_names;
+
+    static bool isRequired(void) { return true; }
+
+    struct Worker {
+        PassBuilder PB;
+        FunctionAnalysisManager FAM;
+        Array<FunctionPassManager> passes;
+
+        Worker(ArrayRef<std::string> pass_names, ModuleAnalysisManager &MAM) {
+            PB.registerFunctionAnalyses(FAM);
+            /* Only for the cached module results, which are not changed while the workers run. */
+            FAM.registerPass([&] { return ModuleAnalysisManagerFunctionProxy(MAM); });
+            for (auto &name : pass_names) {
+                passes.emplace_back();
+                register_function_pass(name, passes.back());
+            }
+        }
+
+        void run(Function &func) {
+            for (auto &pass : passes) {
+                pass.run(func, FAM);
+            }
+            FAM.clear(func, func.getName());
+        }
+    };
+
+    auto run(Module &module, ModuleAnalysisManager &AM) {
+        TimeTraceScope time_scope("Parallel", module.getModuleIdentifier());
+        raw_ostream &os = output_target();
+
+        Array<Function *> functions;
+        for (auto &func : module) {
+            if (!func.isDeclaration()) functions.push_back(&func);
+        }
+
+        std::vector<std::string> buffers(functions.size());
+        std::vector<bool> done(functions.size());
+        u32 printed = 0;
+        std::mutex print_lock;
+        std::atomic<u32> next = 0;
+
+        /* Every thread has its own profiler, the ones of the workers are merged into the main one when they finish. */
+        bool tracing = timeTraceProfilerEnabled();
+        u32 granularity = parallel_time_trace_granularity;
+
+        ThreadPool pool(hardware_concurrency(parallel_threads));
+        for (u32 thread = 0; thread < pool.getThreadCount(); thread++) {
+            pool.async([&] {
+                if (tracing) timeTraceProfilerInitialize(granularity, "Parallel");
+
+                Worker worker(pass_names, AM);
+                for (u32 i = next++; i < functions.size(); i = next++) {
+                    {
+                        raw_string_ostream buffer(buffers[i]);
+                        ScopedOutput scoped(buffer);
+                        worker.run(*functions[i]);
+                    }
+
+                    std::lock_guard<std::mutex> guard(print_lock);
+                    done[i] = true;
+                    for (; printed < functions.size() && done[printed]; printed++) {
+                        os << buffers[printed];
+                        std::string().swap(buffers[printed]);
+                    }
+                }
+
+                if (tracing) timeTraceProfilerFinishThread();
+            });
+        }
+        pool.wait();
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_module_passes(
+    StringRef pass_name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement> inner_pipeline
+) {
+    if (pass_name == "Parallel") {
+        ParallelPass pass;
+        for (auto &element : inner_pipeline) {
+            FunctionPassManager FPM;
+            if (!element.InnerPipeline.empty() || !register_function_pass(element.Name, FPM)) return false;
+            if (!is_thread_safe(element.Name)) {
+                errs() << "Parallel: " << element.Name << " is not a read-only pass that can run on the workers\n";
+                return false;
+            }
+            pass.pass_names.push_back(element.Name.str());
+        }
+        MPM.addPass(std::move(pass));
+        return true;
+    }
+    if (!inner_pipeline.empty()) return false;
+
+    if (pass_name == "ModuleInstrCount") {
+        MPM.addPass(ModuleInstructionCounterPass());
+        return true;
+    }
+    if (pass_name == "InstrDiff") {
+        MPM.addPass(InstructionDiffPass());
+        return true;
+    }
+    if (register_function_summary_pass(pass_name, MPM)) return true;
+    if (register_loop_profile_pass(pass_name, MPM)) return true;
+    return false;
+}
+
+void set_time_trace_granularity(u32 granularity) {
+    if (parallel_time_trace_granularity.getNumOccurrences()) return;
+    parallel_time_trace_granularity = granularity;
+}
+
 PassPluginLibraryInfo get_plugin_info(void) {
     return {
         LLVM_PLUGIN_API_VERSION,
         "CustomPasses",
-        "v0.1",
+        PLUGIN_VERSION,
         [](PassBuilder &PB) {
-            PB.registerPipelineParsingCallback(register_passes);
-            PB.registerPipelineParsingCallback(register_fuse_pass);
+            if (auto PIC = PB.getPassInstrumentationCallbacks()) {
+                register_memory_usage_callbacks(*PIC);
+            }
+
+            for (auto registry : function_pass_registries) {
+                PB.registerPipelineParsingCallback(registry);
+            }
+            PB.registerPipelineParsingCallback(register_module_passes);
+
+            PB.registerAnalysisRegistrationCallback(register_affine_access_analysis);
+            PB.registerAnalysisRegistrationCallback(register_trip_count_analysis);
+            PB.registerAnalysisRegistrationCallback(register_static_frequency_analysis);
+            PB.registerAnalysisRegistrationCallback(register_induction_analysis);
+            PB.registerAnalysisRegistrationCallback(register_iv_range_analysis);
+            PB.registerAnalysisRegistrationCallback(register_register_pressure_analysis);
+            PB.registerAnalysisRegistrationCallback(register_critical_path_analysis);
+            PB.registerAnalysisRegistrationCallback(register_function_summary_analysis);
         }
     };
 }
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "llvm/Passes/PassPlugin.h"
+
+#include "Common.hpp"
+
+/* Part of the keys of the analysis cache, entries of other versions are never used. */
+inline constexpr const char *PLUGIN_VERSION = "v0.1";
+
+/* Registers all passes and analyses of the plugin, shared by opt and custom-opt. */
+llvm::PassPluginLibraryInfo get_plugin_info(void);
+
+/* Granularity in microseconds the workers of Parallel(...) trace with, for tools that know the one
+ * of their own profiler. An explicit -parallel-time-trace-granularity takes precedence. */
+void set_time_trace_granularity(u32 granularity);
@@ -0,0 +1,357 @@
+#include "RegisterPressure.hpp"
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.hpp"
+#include "Output.hpp"
+
+using namespace llvm;
+
+AnalysisKey RegisterPressureAnalysis::Key;
+
+namespace {
+
+/* Values that occupy a register: results of instructions and arguments,
+ * except static allocas which are addressed relative to the frame. */
+bool needs_register(const Value *value) {
+    if (!isa<Instruction>(value) && !isa<Argument>(value)) return false;
+
+    Type *type = value->getType();
+    if (type->isVoidTy() || type->isTokenTy() || type->isLabelTy() || type->isMetadataTy()) return false;
+
+    if (auto *alloca = dyn_cast<AllocaInst>(value)) {
+        if (alloca->isStaticAlloca()) return false;
+    }
+    return true;
+}
+
+u32 get_register_class(const Value *value, const TargetTransformInfo &TTI) {
+    Type *type = value->getType();
+    return TTI.getRegisterClassForType(type->isVectorTy(), type);
+}
+
+/* Backward liveness restricted to the blocks of a single loop.
+ * Values are numbered densely so live sets are bit vectors. */
+struct LoopLiveness {
+    Loop *loop;
+    LoopInfo &LI;
+    const TargetTransformInfo &TTI;
+
+    Array<BasicBlock *> blocks;
+    DenseMap<const BasicBlock *, u32> block_ids;
+
+    Array<Value *> values;
+    Array<u32> classes;
+    DenseMap<const Value *, u32> value_ids;
+
+    Array<BitVector> live_in;
+    Array<BitVector> live_out;
+
+    LoopLiveness(Loop *loop, LoopInfo &LI, const TargetTransformInfo &TTI) : loop(loop), LI(LI), TTI(TTI) {}
+
+    s32 get_id(const Value *value) {
+        auto it = value_ids.find(value);
+        if (it == value_ids.end()) return -1;
+        return it->second;
+    }
+
+    void number(Value *value) {
+        if (!needs_register(value) || value_ids.count(value)) return;
+
+        value_ids[value] = values.size();
+        values.push_back(value);
+        classes.push_back(get_register_class(value, TTI));
+    }
+
+    void number_values(void) {
+        for (BasicBlock *bb : blocks) {
+            for (auto &instr : *bb) {
+                number(&instr);
+                for (Value *operand : instr.operands()) {
+                    number(operand);
+                }
+            }
+        }
+    }
+
+    /* Values live on the edge from bb into its successor succ. */
+    void add_edge_uses(BitVector &live, BasicBlock *bb, BasicBlock *succ) {
+        for (auto &phi : succ->phis()) {
+            s32 id = get_id(phi.getIncomingValueForBlock(bb));
+            if (id >= 0) live.set(id);
+        }
+    }
+
+    /* Values defined inside of the loop that are used after it. */
+    void add_escaping(BitVector &live) {
+        for (auto [id, value] : enumerate(values)) {
+            auto *instr = dyn_cast<Instruction>(value);
+            if (!instr || !loop->contains(instr)) continue;
+
+            for (User *user : instr->users()) {
+                if (!loop->contains(cast<Instruction>(user))) {
+                    live.set(id);
+                    break;
+                }
+            }
+        }
+    }
+
+    void solve(void) {
+        LoopBlocksRPO rpo(loop);
+        rpo.perform(&LI);
+        for (BasicBlock *bb : rpo) {
+            block_ids[bb] = blocks.size();
+            blocks.push_back(bb);
+        }
+
+        number_values();
+
+        BitVector escaping(values.size());
+        add_escaping(escaping);
+
+        /* Uses that are reached from the top of the block and definitions of it. */
+        Array<BitVector> uses(blocks.size(), BitVector(values.size()));
+        Array<BitVector> defs(blocks.size(), BitVector(values.size()));
+        for (auto [bb_id, bb] : enumerate(blocks)) {
+            for (auto &instr : reverse(*bb)) {
+                s32 id = get_id(&instr);
+                if (id >= 0) {
+                    defs[bb_id].set(id);
+                    uses[bb_id].reset(id);
+                }
+                if (isa<PHINode>(instr)) continue;
+
+                for (Value *operand : instr.operands()) {
+                    s32 operand_id = get_id(operand);
+                    if (operand_id >= 0) uses[bb_id].set(operand_id);
+                }
+            }
+        }
+
+        live_in.assign(blocks.size(), BitVector(values.size()));
+        live_out.assign(blocks.size(), BitVector(values.size()));
+
+        /* Visiting the blocks in reverse of RPO converges in a couple of rounds,
+         * the back edges are what need the extra iterations. */
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (u32 bb_id = blocks.size(); bb_id-- > 0;) {
+                BasicBlock *bb = blocks[bb_id];
+
+                BitVector out(values.size());
+                for (BasicBlock *succ : successors(bb)) {
+                    auto it = block_ids.find(succ);
+                    if (it == block_ids.end()) {
+                        out |= escaping;
+                    } else {
+                        out |= live_in[it->second];
+                    }
+                    add_edge_uses(out, bb, succ);
+                }
+
+                BitVector in = out;
+                in.reset(defs[bb_id]);
+                in |= uses[bb_id];
+
+                if (in != live_in[bb_id] || out != live_out[bb_id]) {
+                    live_in[bb_id] = std::move(in);
+                    live_out[bb_id] = std::move(out);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    void count(Array<u32> &live, u32 id, s32 delta) {
+        u32 reg_class = classes[id];
+        if (live.size() <= reg_class) live.resize(reg_class + 1, 0);
+        live[reg_class] += delta;
+    }
+
+    void update_max(Array<u32> &max_live, const Array<u32> &live) {
+        if (max_live.size() < live.size()) max_live.resize(live.size(), 0);
+        for (auto [max, current] : zip(max_live, live)) {
+            max = std::max(max, current);
+        }
+    }
+
+    /* Walks every block bottom up from its live-out set, the pressure at each point
+     * is the number of values that are defined above and still used below. */
+    void max_pressure(Array<u32> &max_live) {
+        for (auto [bb_id, bb] : enumerate(blocks)) {
+            BitVector live = live_out[bb_id];
+            Array<u32> counts;
+            for (u32 id : live.set_bits()) {
+                count(counts, id, 1);
+            }
+            update_max(max_live, counts);
+
+            for (auto &instr : reverse(*bb)) {
+                if (isa<PHINode>(instr)) break;
+
+                s32 id = get_id(&instr);
+                if (id >= 0 && live.test(id)) {
+                    live.reset(id);
+                    count(counts, id, -1);
+                }
+                for (Value *operand : instr.operands()) {
+                    s32 operand_id = get_id(operand);
+                    if (operand_id >= 0 && !live.test(operand_id)) {
+                        live.set(operand_id);
+                        count(counts, operand_id, 1);
+                    }
+                }
+                update_max(max_live, counts);
+            }
+
+            /* All phis are defined at once on entry to the block. */
+            for (auto &phi : bb->phis()) {
+                s32 id = get_id(&phi);
+                if (id >= 0 && !live.test(id)) {
+                    live.set(id);
+                    count(counts, id, 1);
+                }
+            }
+            update_max(max_live, counts);
+        }
+    }
+
+    void live_through(Array<Value *> &invariants) {
+        if (blocks.empty()) return;
+
+        for (u32 id : live_in[0].set_bits()) {
+            auto *instr = dyn_cast<Instruction>(values[id]);
+            if (!instr || !loop->contains(instr)) {
+                invariants.push_back(values[id]);
+            }
+        }
+    }
+};
+
+}  // namespace
+
+void compute_loop_pressure(LoopPressure &pressure, Loop *loop, LoopInfo &LI, const TargetTransformInfo &TTI) {
+    pressure.loop = loop;
+    pressure.max_live.clear();
+    pressure.invariants.clear();
+
+    LoopLiveness liveness(loop, LI, TTI);
+    liveness.solve();
+    liveness.max_pressure(pressure.max_live);
+    liveness.live_through(pressure.invariants);
+}
+
+void combine_pressure(LoopPressure &into, const LoopPressure &other, const TargetTransformInfo &TTI) {
+    if (into.max_live.size() < other.max_live.size()) into.max_live.resize(other.max_live.size(), 0);
+    for (auto [max, other_max] : zip(into.max_live, other.max_live)) {
+        max += other_max;
+    }
+
+    /* Invariants used by both loops occupy a single register after fusion. */
+    SmallPtrSet<Value *, 16> seen(into.invariants.begin(), into.invariants.end());
+    for (Value *value : other.invariants) {
+        if (seen.insert(value).second) {
+            into.invariants.push_back(value);
+        } else {
+            into.max_live[get_register_class(value, TTI)] -= 1;
+        }
+    }
+}
+
+bool exceeds_registers(ArrayRef<u32> max_live, const TargetTransformInfo &TTI) {
+    for (auto [reg_class, live] : enumerate(max_live)) {
+        if (live > TTI.getNumberOfRegisters(reg_class)) return true;
+    }
+    return false;
+}
+
+const LoopPressure *RegisterPressureInfo::lookup(const Loop *loop) const {
+    auto it = index.find(loop);
+    if (it == index.end()) return nullptr;
+    return &loops[it->second];
+}
+
+bool RegisterPressureInfo::invalidate(
+    Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv
+) {
+    auto checker = PA.getChecker<RegisterPressureAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<LoopAnalysis>(func, PA);
+}
+
+RegisterPressureInfo RegisterPressureAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &TTI = AM.getResult<TargetIRAnalysis>(func);
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+
+    RegisterPressureInfo info;
+    for (Loop *loop : LA.getLoopsInPreorder()) {
+        LoopPressure pressure;
+        compute_loop_pressure(pressure, loop, LA, TTI);
+
+        info.index[loop] = info.loops.size();
+        info.loops.push_back(std::move(pressure));
+    }
+
+    return info;
+}
+
+namespace {
+
+struct RegisterPressurePrintPass : PassInfoMixin<RegisterPressurePrintPass> {
+    static bool isRequired(void) { return true; }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("RegPressure", func.getName());
+        out() << "\n[RegPressure]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &TTI = AM.getResult<TargetIRAnalysis>(func);
+        auto &info = AM.getResult<RegisterPressureAnalysis>(func);
+        for (auto &pressure : info.loops) {
+            if (has_result_sink()) {
+                for (auto [reg_class, live] : enumerate(pressure.max_live)) {
+                    if (live == 0) continue;
+                    emit(Record("RegPressure", func)
+                        .add("loop", pressure.loop->getName())
+                        .add("class", TTI.getRegisterClassName(reg_class))
+                        .add("max_live", live)
+                        .add("registers", TTI.getNumberOfRegisters(reg_class)));
+                }
+                continue;
+            }
+
+            out().indent(pressure.loop->getLoopDepth() * 2) << "Loop at " << pressure.loop->getName() << ":";
+            for (auto [reg_class, live] : enumerate(pressure.max_live)) {
+                if (live == 0) continue;
+                out() << " " << TTI.getRegisterClassName(reg_class)
+                    << " " << live << "/" << TTI.getNumberOfRegisters(reg_class);
+            }
+            if (exceeds_registers(pressure.max_live, TTI)) {
+                out() << " (spills)";
+            }
+            out() << "\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_register_pressure_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "RegPressure") {
+        add_cacheable_pass(FPM, "RegPressure", RegisterPressurePrintPass());
+        return true;
+    }
+    return false;
+}
+
+void register_register_pressure_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return RegisterPressureAnalysis(); });
+}
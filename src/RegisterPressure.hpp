@@ -0,0 +1,53 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* Maximum number of simultaneously live SSA values inside of a loop body,
+ * indexed by the TTI register class of the values. */
+struct LoopPressure {
+    llvm::Loop *loop = nullptr;
+    Array<u32> max_live;
+    /* Values defined outside of the loop that stay live through all of it. */
+    Array<llvm::Value *> invariants;
+};
+
+void compute_loop_pressure(
+    LoopPressure &pressure, llvm::Loop *loop, llvm::LoopInfo &LI, const llvm::TargetTransformInfo &TTI
+);
+
+/* Estimate for the body of two fused loops: the pressures add up,
+ * but invariants shared by both loops are counted once. */
+void combine_pressure(LoopPressure &into, const LoopPressure &other, const llvm::TargetTransformInfo &TTI);
+
+/* True if any register class needs more registers than the target has. */
+bool exceeds_registers(llvm::ArrayRef<u32> max_live, const llvm::TargetTransformInfo &TTI);
+
+struct RegisterPressureInfo {
+    Array<LoopPressure> loops;
+    llvm::DenseMap<const llvm::Loop *, u32> index;
+
+    const LoopPressure *lookup(const llvm::Loop *loop) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct RegisterPressureAnalysis : llvm::AnalysisInfoMixin<RegisterPressureAnalysis> {
+    using Result = RegisterPressureInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<RegisterPressureAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+bool register_register_pressure_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_register_pressure_analysis(llvm::FunctionAnalysisManager &FAM);
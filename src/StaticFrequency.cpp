@@ -0,0 +1,272 @@
+#include "StaticFrequency.hpp"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AnalysisCache.hpp"
+#include "Output.hpp"
+#include "TripCount.hpp"
+
+using namespace llvm;
+
+static cl::opt<f64> static_freq_hot_threshold(
+    "static-freq-hot-threshold",
+    cl::desc("Expected executions per call above which a block is considered hot"),
+    cl::init(100.0)
+);
+
+static cl::opt<f64> static_freq_max_trip_count(
+    "static-freq-max-trip-count",
+    cl::desc("Upper limit for the trip count guessed from the back edge probabilities"),
+    cl::init(1000.0)
+);
+
+AnalysisKey StaticFrequencyAnalysis::Key;
+
+std::string static_frequency_options(void) {
+    std::string options;
+    raw_string_ostream(options) << static_freq_hot_threshold << ',' << static_freq_max_trip_count;
+    return options;
+}
+
+namespace {
+
+f64 to_f64(BranchProbability probability) {
+    return (f64)probability.getNumerator() / (f64)probability.getDenominator();
+}
+
+/* Frequencies are built in two sweeps over the loop forest.
+ * Bottom up, every loop gets the mass of its blocks relative to one execution of its header
+ * (local mass, acyclic propagation in RPO) and the distribution of the mass leaving it.
+ * A sub loop is treated as a single node of its parent: its header receives the mass
+ * and forwards it through its exits. Top down, the local masses are scaled
+ * by the absolute frequency of the header, which is the entry mass times the trip count. */
+struct FrequencyBuilder {
+    Function &func;
+    LoopInfo &LI;
+    BranchProbabilityInfo &BPI;
+    const TripCountInfo &TC;
+    StaticFrequencyInfo &info;
+
+    Array<BasicBlock *> rpo;
+    DenseMap<const BasicBlock *, u32> rpo_index;
+
+    DenseMap<const BasicBlock *, f64> local;
+    DenseMap<const Loop *, f64> unit_mass;
+    DenseMap<const Loop *, Array<std::tuple<BasicBlock *, BasicBlock *, f64>>> exits;
+
+    FrequencyBuilder(
+        Function &func, LoopInfo &LI, BranchProbabilityInfo &BPI, const TripCountInfo &TC, StaticFrequencyInfo &info
+    ) : func(func), LI(LI), BPI(BPI), TC(TC), info(info) {}
+
+    void order_blocks() {
+        for (BasicBlock *bb : ReversePostOrderTraversal<Function *>(&func)) {
+            rpo_index[bb] = rpo.size();
+            rpo.push_back(bb);
+        }
+    }
+
+    Array<BasicBlock *> region_blocks(Loop *loop) {
+        if (!loop) return rpo;
+
+        Array<BasicBlock *> blocks;
+        for (BasicBlock *bb : loop->blocks()) {
+            if (rpo_index.count(bb)) blocks.push_back(bb);
+        }
+        llvm::sort(blocks, [&](BasicBlock *a, BasicBlock *b) { return rpo_index[a] < rpo_index[b]; });
+        return blocks;
+    }
+
+    /* loop is nullptr for the part of the function outside of all loops. */
+    void propagate(Loop *loop) {
+        BasicBlock *head = loop ? loop->getHeader() : &func.getEntryBlock();
+
+        DenseMap<const BasicBlock *, f64> incoming;
+        incoming[head] = 1.0;
+
+        f64 back_mass = 0;
+        f64 exit_mass = 0;
+        Array<std::tuple<BasicBlock *, BasicBlock *, f64>> out;
+
+        auto send = [&](BasicBlock *from, BasicBlock *to, f64 mass) {
+            if (loop && to == head) {
+                back_mass += mass;
+            } else if (loop && !loop->contains(to)) {
+                out.push_back({from, to, mass});
+                exit_mass += mass;
+            } else {
+                incoming[to] += mass;
+            }
+        };
+
+        for (BasicBlock *bb : region_blocks(loop)) {
+            Loop *inner = LI.getLoopFor(bb);
+            f64 mass = incoming.lookup(bb);
+
+            if (inner == loop) {
+                local[bb] = mass;
+
+                auto *term = bb->getTerminator();
+                auto end = term->getNumSuccessors();
+                for (u32 i = 0; i < end; ++i) {
+                    send(bb, term->getSuccessor(i), mass * to_f64(BPI.getEdgeProbability(bb, i)));
+                }
+            } else if (inner->getHeader() == bb && inner->getParentLoop() == loop) {
+                unit_mass[inner] = mass;
+                for (auto [from, to, share] : exits[inner]) {
+                    send(from, to, mass * share);
+                }
+            }
+        }
+
+        if (!loop) return;
+
+        for (auto &[from, to, mass] : out) {
+            mass = exit_mass > 0 ? mass / exit_mass : 0;
+        }
+        exits[loop] = std::move(out);
+
+        f64 trips = (f64)TC.estimate(loop);
+        if (trips == 0) {
+            trips = back_mass < 1.0 ? 1.0 / (1.0 - back_mass) : static_freq_max_trip_count;
+            trips = std::min(trips, (f64)static_freq_max_trip_count);
+        }
+        info.trips[loop] = trips;
+    }
+
+    void assign(Loop *loop, f64 scale) {
+        for (BasicBlock *bb : region_blocks(loop)) {
+            if (LI.getLoopFor(bb) != loop) continue;
+
+            f64 frequency = scale * local.lookup(bb);
+            info.blocks[bb] = frequency;
+            info.max_frequency = std::max(info.max_frequency, frequency);
+        }
+
+        auto &sub_loops = loop ? loop->getSubLoops() : LI.getTopLevelLoops();
+        for (Loop *sub_loop : sub_loops) {
+            assign(sub_loop, scale * unit_mass.lookup(sub_loop) * info.trips[sub_loop]);
+        }
+    }
+
+    void build() {
+        order_blocks();
+
+        /* Reversed preorder visits sub loops before their parents. */
+        auto loops = LI.getLoopsInPreorder();
+        for (Loop *loop : reverse(loops)) {
+            propagate(loop);
+        }
+        propagate(nullptr);
+
+        assign(nullptr, 1.0);
+
+        for (BasicBlock *bb : rpo) {
+            f64 frequency = info.blocks.lookup(bb);
+
+            auto *term = bb->getTerminator();
+            auto end = term->getNumSuccessors();
+            for (u32 i = 0; i < end; ++i) {
+                info.edges[{bb, term->getSuccessor(i)}] += frequency * to_f64(BPI.getEdgeProbability(bb, i));
+            }
+        }
+    }
+};
+
+}  // namespace
+
+f64 StaticFrequencyInfo::frequency(const BasicBlock *bb) const {
+    return blocks.lookup(bb);
+}
+
+f64 StaticFrequencyInfo::edge_frequency(const BasicBlock *src, const BasicBlock *dst) const {
+    return edges.lookup({src, dst});
+}
+
+bool StaticFrequencyInfo::is_hot(const BasicBlock *bb) const {
+    return frequency(bb) >= static_freq_hot_threshold;
+}
+
+bool StaticFrequencyInfo::invalidate(
+    Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv
+) {
+    auto checker = PA.getChecker<StaticFrequencyAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<LoopAnalysis>(func, PA)
+        || inv.invalidate<BranchProbabilityAnalysis>(func, PA)
+        || inv.invalidate<TripCountAnalysis>(func, PA);
+}
+
+StaticFrequencyInfo StaticFrequencyAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+    auto &BPI = AM.getResult<BranchProbabilityAnalysis>(func);
+    auto &TC = AM.getResult<TripCountAnalysis>(func);
+
+    StaticFrequencyInfo info;
+    FrequencyBuilder builder(func, LA, BPI, TC, info);
+    builder.build();
+
+    return info;
+}
+
+namespace {
+
+struct StaticFrequencyPrintPass : PassInfoMixin<StaticFrequencyPrintPass> {
+    static bool isRequired(void) { return true; }
+
+    auto run(Function &func, FunctionAnalysisManager &AM) {
+        TimeTraceScope time_scope("StaticFreq", func.getName());
+        out() << "\n[StaticFreq]\n";
+        out() << "Function " << func.getName() << "():\n";
+
+        auto &LA = AM.getResult<LoopAnalysis>(func);
+        auto &SF = AM.getResult<StaticFrequencyAnalysis>(func);
+
+        for (auto &bb : func) {
+            if (has_result_sink()) {
+                emit(Record("StaticFreq", func)
+                    .add("block", bb.getName())
+                    .add("frequency", SF.frequency(&bb))
+                    .add("hot", SF.is_hot(&bb)));
+                continue;
+            }
+
+            out() << "  Block '" << bb.getName() << "': " << format("%.2f", SF.frequency(&bb));
+            if (SF.is_hot(&bb)) {
+                out() << " (hot)";
+            }
+            out() << "\n";
+        }
+
+        for (Loop *loop : LA.getLoopsInPreorder()) {
+            if (has_result_sink()) {
+                emit(Record("StaticFreq", func).add("loop", loop->getName()).add("trip_count", SF.trips.lookup(loop)));
+                continue;
+            }
+
+            out() << "  Loop at " << loop->getName() << "': expected trip count "
+                   << format("%.2f", SF.trips.lookup(loop)) << "\n";
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
+}  // namespace
+
+bool register_static_frequency_pass(StringRef pass_name, FunctionPassManager &FPM, ...) {
+    if (pass_name == "StaticFreq") {
+        add_cacheable_pass(FPM, "StaticFreq", StaticFrequencyPrintPass(), static_frequency_options());
+        return true;
+    }
+    return false;
+}
+
+void register_static_frequency_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return StaticFrequencyAnalysis(); });
+}
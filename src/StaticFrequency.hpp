@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <utility>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include "Common.hpp"
+
+/* Expected number of executions of every block per call of the function,
+ * estimated without profile data: branch probabilities inside of a loop body,
+ * multiplied by the trip counts of the enclosing loops. */
+struct StaticFrequencyInfo {
+    llvm::DenseMap<const llvm::BasicBlock *, f64> blocks;
+    llvm::DenseMap<std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>, f64> edges;
+    /* Trip count that was used for every loop, either from TripCountAnalysis
+     * or derived from the back edge probabilities. */
+    llvm::DenseMap<const llvm::Loop *, f64> trips;
+    f64 max_frequency = 0;
+
+    f64 frequency(const llvm::BasicBlock *bb) const;
+    f64 edge_frequency(const llvm::BasicBlock *src, const llvm::BasicBlock *dst) const;
+    bool is_hot(const llvm::BasicBlock *bb) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct StaticFrequencyAnalysis : llvm::AnalysisInfoMixin<StaticFrequencyAnalysis> {
+    using Result = StaticFrequencyInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<StaticFrequencyAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+/* Values of the options that change the estimates, part of the keys of the analysis cache. */
+std::string static_frequency_options(void);
+
+bool register_static_frequency_pass(llvm::StringRef pass_name, llvm::FunctionPassManager &FPM, ...);
+void register_static_frequency_analysis(llvm::FunctionAnalysisManager &FAM);
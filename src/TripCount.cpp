@@ -0,0 +1,121 @@
+#include "TripCount.hpp"
+
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
+
+AnalysisKey TripCountAnalysis::Key;
+
+namespace {
+
+u64 saturating_product(u64 a, u64 b) {
+    if (a == 0 || b == 0) return 0;
+    return SaturatingMultiply(a, b);
+}
+
+struct TripCountBuilder {
+    ScalarEvolution &SE;
+    TripCountInfo &info;
+    Type *count_type;
+
+    void add_loop(Loop *loop, const SCEV *parent_space, u64 parent_max_space) {
+        LoopTripCount entry;
+        entry.loop = loop;
+        entry.depth = loop->getLoopDepth();
+
+        entry.backedge_taken = SE.getBackedgeTakenCount(loop);
+        entry.exact = SE.getSmallConstantTripCount(loop);
+        entry.max = SE.getSmallConstantMaxTripCount(loop);
+        entry.multiple = SE.getSmallConstantTripMultiple(loop);
+
+        if (isa<SCEVCouldNotCompute>(entry.backedge_taken)) {
+            entry.trip_count = entry.backedge_taken;
+            entry.space = entry.backedge_taken;
+        } else {
+            const SCEV *taken = SE.getTruncateOrZeroExtend(entry.backedge_taken, count_type);
+            entry.trip_count = SE.getAddExpr(taken, SE.getOne(count_type));
+            entry.space = isa<SCEVCouldNotCompute>(parent_space)
+                ? parent_space
+                : SE.getMulExpr(parent_space, entry.trip_count);
+        }
+        entry.max_space = saturating_product(parent_max_space, entry.max);
+
+        info.index[loop] = info.loops.size();
+        info.loops.push_back(entry);
+
+        for (Loop *sub_loop : loop->getSubLoops()) {
+            add_loop(sub_loop, entry.space, entry.max_space);
+        }
+    }
+
+    /* Sums the spaces of the innermost loops under loop. */
+    void add_leaves(Loop *loop, Array<const SCEV *> &spaces, u64 &max_iterations, bool &max_known) {
+        if (loop->isInnermost()) {
+            auto &entry = info.loops[info.index[loop]];
+            spaces.push_back(entry.space);
+            max_known = max_known && entry.max_space != 0;
+            max_iterations = SaturatingAdd(max_iterations, entry.max_space);
+            return;
+        }
+        for (Loop *sub_loop : loop->getSubLoops()) {
+            add_leaves(sub_loop, spaces, max_iterations, max_known);
+        }
+    }
+};
+
+}  // namespace
+
+const LoopTripCount *TripCountInfo::lookup(const Loop *loop) const {
+    auto it = index.find(loop);
+    if (it == index.end()) return nullptr;
+    return &loops[it->second];
+}
+
+u64 TripCountInfo::estimate(const Loop *loop) const {
+    auto *entry = lookup(loop);
+    if (!entry) return 0;
+    return entry->exact ? entry->exact : entry->max;
+}
+
+bool TripCountInfo::invalidate(Function &func, const PreservedAnalyses &PA, FunctionAnalysisManager::Invalidator &inv) {
+    auto checker = PA.getChecker<TripCountAnalysis>();
+    return !(checker.preserved() || checker.preservedSet<AllAnalysesOn<Function>>())
+        || inv.invalidate<ScalarEvolutionAnalysis>(func, PA)
+        || inv.invalidate<LoopAnalysis>(func, PA);
+}
+
+TripCountInfo TripCountAnalysis::run(Function &func, FunctionAnalysisManager &AM) {
+    auto &SE = AM.getResult<ScalarEvolutionAnalysis>(func);
+    auto &LA = AM.getResult<LoopAnalysis>(func);
+
+    TripCountInfo info;
+    Type *count_type = Type::getInt64Ty(func.getContext());
+    TripCountBuilder builder = {SE, info, count_type};
+
+    for (Loop *loop : LA) {
+        builder.add_loop(loop, SE.getOne(count_type), 1);
+    }
+
+    for (Loop *loop : LA) {
+        Array<const SCEV *> spaces;
+        u64 max_iterations = 0;
+        bool max_known = true;
+        builder.add_leaves(loop, spaces, max_iterations, max_known);
+
+        NestTripCount nest;
+        nest.loop = loop;
+        nest.max_iterations = max_known ? max_iterations : 0;
+        nest.iterations = SE.getCouldNotCompute();
+        if (none_of(spaces, [](const SCEV *space) { return isa<SCEVCouldNotCompute>(space); })) {
+            nest.iterations = SE.getAddExpr(spaces);
+        }
+        info.nests.push_back(nest);
+    }
+
+    return info;
+}
+
+void register_trip_count_analysis(FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return TripCountAnalysis(); });
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/PassManager.h"
+
+#include "Common.hpp"
+
+/* Trip count facts of a single loop, gathered once from SCEV.
+ * Constant fields are 0 when the value is unknown. */
+struct LoopTripCount {
+    llvm::Loop *loop = nullptr;
+    u32 depth = 0;
+
+    /* Symbolic, may be SCEVCouldNotCompute. */
+    const llvm::SCEV *backedge_taken = nullptr;
+    /* backedge_taken + 1 as i64. */
+    const llvm::SCEV *trip_count = nullptr;
+
+    u64 exact = 0;
+    u64 max = 0;
+    u64 multiple = 1;
+
+    /* Number of times the header runs per entry into the outermost loop of the nest,
+     * the product of the trip counts of this loop and all of its parents. */
+    const llvm::SCEV *space = nullptr;
+    u64 max_space = 0;
+};
+
+/* Total iteration space of an outermost loop: the sum of the spaces of its innermost loops. */
+struct NestTripCount {
+    llvm::Loop *loop = nullptr;
+    const llvm::SCEV *iterations = nullptr;
+    u64 max_iterations = 0;
+};
+
+struct TripCountInfo {
+    /* Every loop of the function in preorder, parents before their sub loops. */
+    Array<LoopTripCount> loops;
+    Array<NestTripCount> nests;
+    llvm::DenseMap<const llvm::Loop *, u32> index;
+
+    const LoopTripCount *lookup(const llvm::Loop *loop) const;
+
+    /* Exact trip count if known, constant max trip count otherwise, 0 if neither is. */
+    u64 estimate(const llvm::Loop *loop) const;
+
+    bool invalidate(
+        llvm::Function &func, const llvm::PreservedAnalyses &PA, llvm::FunctionAnalysisManager::Invalidator &inv
+    );
+};
+
+struct TripCountAnalysis : llvm::AnalysisInfoMixin<TripCountAnalysis> {
+    using Result = TripCountInfo;
+
+    Result run(llvm::Function &func, llvm::FunctionAnalysisManager &AM);
+
+private:
+    friend llvm::AnalysisInfoMixin<TripCountAnalysis>;
+    static llvm::AnalysisKey Key;
+};
+
+void register_trip_count_analysis(llvm::FunctionAnalysisManager &FAM);